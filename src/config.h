@@ -8,6 +8,11 @@
 #define END_KEY  ('e' & 0x1f)
 #define SAVE_KEY ('s' & 0x1f)
 #define FIND_KEY ('f' & 0x1f)
+#define REPLACE_KEY ('g' & 0x1f)
+#define UNDO_KEY ('z' & 0x1f)
+#define REDO_KEY ('y' & 0x1f)
+#define CASE_KEY ('t' & 0x1f)
+#define REGEX_KEY ('r' & 0x1f)
 #define NEXTLINE ('n' & 0x1f)
 #define PREVLINE ('p' & 0x1f)
 
@@ -1,5 +1,7 @@
 /* incluaes */
 
+#define _DEFAULT_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
@@ -12,17 +14,77 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#endif
 
 #include "config.h"
 #include "synhl.h"
 
 /* defines */
 
-#define _DEFAULT_SOURCE
-
 #define OLICH_VERSION "0.0.1"
+#ifndef CTRL
 #define CTRL(k) ((k) & 0x1f)
-#define BUFFER_INIT {NULL, 0}
+#endif
+#define BUFFER_INIT {NULL, 0, 0}
+#define HL_LOOKAHEAD 8
+#define HL_IDLE_LINES 65536
+#define MATCH_IDLE_LINES 65536
+#define INPUT_RING 65536
+#define ESC_SEQ_MAX 16
+#define PASTE_END "\x1b[201~"
+#define PASTE_END_LEN 6
+#define PASTE_TIMEOUT 5000
+#define ESC_TIMEOUT 100
+#define STATUS_TIMEOUT 5000
+#define TIMER_TICK 50
+#define TIMER_SLOTS 64
+#define SEARCH_SAMPLE 65536
+#define RE_STATES 512
+#define RE_HASH 2048
+#define RE_BREAK(c) ((c) == '\n' || (c) == '\r')
+#define SAVE_IOV 1024
+#define SAVE_COPY_MIN 65536
+#define UNDO_LIMIT (32 << 20)
+#define SLAB_CHUNK 65536
+#define SLAB_HEADER 16
+#define ROW_CLASS_MIN 16
+#define ROW_CLASS_MAX 4096
+#define ROW_CLASSES 9
+#define LEX_CHUNK 4096
+#define LOAD_THREADS 8
+#define LOAD_PART_MIN (1 << 20)
+#define STREAM_CHUNK 65536
+#define FOLLOW_RETRY 1000
+
+/* character classes, see build_char_classes */
+
+#define CC_SEP   (1<<0)
+#define CC_DIGIT (1<<1)
+#define CC_QUOTE (1<<2)
+#define CC_SCS   (1<<3)
+#define CC_MCS   (1<<4)
+#define CC_WORD  (1<<5)
+
+#define CELL_INVERSE 0x80
+
+/* regular expression edges and dfa state flags, see re_compile */
+
+#define RE_EPS 0
+#define RE_SET 1
+#define RE_BOL 2
+#define RE_EOL 3
+
+#define RE_FINAL     (1<<0)
+#define RE_EOL_FINAL (1<<1)
 
 /* handling special keys */
 
@@ -35,7 +97,10 @@ enum special_keys {
    DELETE,
    END,
    HOME,
-   ESC
+   ESC,
+   PAGEUP,
+   PAGEDOWN,
+   PASTE
 };
 
 /* custom strings */
@@ -43,13 +108,29 @@ enum special_keys {
 struct buffer {
    char *data;
    int len;
+   int cap;
 };
 
+/* makes room for len more bytes after buf->len */
+
+int buffer_reserve(struct buffer *buf, int len) {
+   char *new;
+   int cap;
+
+   if (buf->len + len > buf->cap) {
+      cap = buf->cap ? buf->cap * 2 : 256;
+      while (cap < buf->len + len) cap *= 2;
+      new = realloc(buf->data, cap);
+      if (new == NULL) return -1;
+      buf->data = new;
+      buf->cap = cap;
+   }
+   return 0;
+}
+
 void buffer_append(struct buffer *buf, const char *s, int len) {
-   char *new = realloc(buf->data, buf->len + len);
-   if (new == NULL) return;
-   memcpy(&new[buf->len], s, len);
-   buf->data = new;
+   if (len == 0 || buffer_reserve(buf, len) == -1) return;
+   memcpy(&buf->data[buf->len], s, len);
    buf->len += len;
 }
 
@@ -60,22 +141,386 @@ void buffer_free(struct buffer *buf) {
 /* data */
 
 typedef struct ed_row_data {
-   int idx;
    int size;
-   int rensize;
-   char *render;
+   int gap;
+   int cap;
+   int tabs;
+   int tabcap;
+   int *tabstop;
+   int hl_upto;
+   int nmarks;
+   int markcap;
+   int *marks;
    char *data;
    unsigned char *highlighted;
    int comment_open;
+   int hl_dirty;
+   int view;
+   int frozen;
 } ed_row_data;
 
+/* a pool of blocks of one size, carved out of SLAB_CHUNK sized
+ * chunks. blocks that are given back are linked through their first
+ * bytes and handed out again first. each chunk starts with a pointer
+ * to the chunk before it, so the whole pool goes with one free per
+ * chunk. */
+
+typedef struct slab_pool {
+   int size;
+   char *free;
+   char *next;
+   char *end;
+   char *chunks;
+} slab_pool;
+
+/* the rows live in a treap ordered by line number, where every node
+ * knows how many lines its subtree holds. a node is either a single
+ * row, or a run of lines that are still untouched in the file
+ * mapping ( E.linestart gives the offset of each of them ). runs are
+ * split when one of their lines is asked for as a row, so a file
+ * that is only scrolled through stays a handful of nodes. */
+
+typedef struct line_node {
+   struct line_node *left;
+   struct line_node *right;
+   unsigned int prio;
+   int count;
+   int nlines;
+   int first;
+   ed_row_data *row;
+} line_node;
+
+/* the keywords and datatypes of the selected syntax, hashed with a
+ * seed that was picked so that no two of them share a slot. a token
+ * is classified by hashing it once and comparing it with one entry. */
+
+typedef struct hl_keyword {
+   char *word;
+   int len;
+   int kind;
+} hl_keyword;
+
+/* a whole screen, one character per column. attrs holds the color
+ * code each cell is drawn with ( 0 for the default color ), or'ed with
+ * CELL_INVERSE */
+
+typedef struct screen_frame {
+   char *chars;
+   unsigned char *attrs;
+} screen_frame;
+
+/* a regular expression as a graph of states joined by edges that take
+ * one byte of a set, or check for the start or the end of a line, or
+ * take nothing. see re_compile */
+
+typedef struct re_edge {
+   int from;
+   int to;
+   int kind;
+   int set;
+} re_edge;
+
+/* the graph seen from one end : edges leaving state s are
+ * edges[first[s] .. first[s+1]). the backward one has every edge
+ * turned around, start and final swapped, and so are the checks for
+ * the start and the end of a line. */
+
+typedef struct re_nfa {
+   re_edge *edges;
+   int *first;
+   int nstates;
+   int start;
+   int final;
+   unsigned char (*sets)[32];
+   int *mark;
+   int *seen;
+   int gen;
+} re_nfa;
+
+/* a state of a dfa that is built as it is run : the nfa states it
+ * stands for, whether a match ends in it, and the state each byte
+ * leads to, or -1 until that byte has been seen there. the low bit of
+ * next is set when a match can end in the state it leads to, so that
+ * the scan loops only look at one table per byte. */
+
+typedef struct re_dstate {
+   int *set;
+   int n;
+   int flags;
+   int next[256];
+} re_dstate;
+
+typedef struct re_dfa {
+   re_nfa *nfa;
+   int unanchored;
+   re_dstate *st;
+   int nst;
+   int flushes;
+   int hash[RE_HASH];
+   int init[2];
+   int *list;
+   int accel_for;
+   int naccel;
+   int accel[2];
+} re_dfa;
+
+typedef struct re_prog {
+   re_edge *edges;
+   int nedges;
+   int edgecap;
+   unsigned char (*sets)[32];
+   int nsets;
+   int nstates;
+   int icase;
+   int err;
+   re_nfa fwd;
+   re_nfa rev;
+   re_dfa scan;
+   re_dfa longest;
+   re_dfa back;
+} re_prog;
+
+/* a compiled search, see search_update */
+
+typedef struct search_query {
+   char *pat;
+   int len;
+   int icase;
+   int valid;
+   unsigned char fold[256];
+   int anchor;
+   int other;
+   int first;
+   int regex;
+   int seek;
+   re_prog *re;
+} search_query;
+
+/* every line holding a match of E.search, in order, with the number
+ * of matches on the lines before it, for lines [0, scanned). it is a
+ * gap buffer, like the rows are : entries past the gap keep their line
+ * relative to scanned and their count relative to total, so an edit
+ * only moves the entries between it and the edit before it, and lines
+ * that come and go shift everything behind them for free. the index
+ * is filled in while idle, and an edit only looks at the lines it
+ * touched. matches are counted without overlapping. */
+
+typedef struct match_index {
+   int *line;
+   int *before;
+   int cap;
+   int gap;
+   int gapend;
+   int scanned;
+   int total;
+} match_index;
+
+/* pieces of the file waiting to be written with one writev, see
+ * save_editor */
+
+typedef struct save_batch {
+   struct iovec iov[SAVE_IOV];
+   int n;
+   int fd;
+   long total;
+} save_batch;
+
+/* the file as it was when a save started : the text of a row ( with
+ * its gap closed ), or when data is NULL a run of mapping lines */
+
+typedef struct save_piece {
+   char *data;
+   int size;
+   int first;
+   int nlines;
+} save_piece;
+
+/* a block of row memory, see row_alloc */
+
+typedef struct row_block {
+   char *data;
+   int cap;
+} row_block;
+
+/* a save being written by a thread of its own. rows whose text it
+ * holds are frozen : their frozen field is gen, and an edit copies
+ * the text out of them before making any change. the text they left
+ * behind is kept in orphans until the save is done with it. the
+ * fields from err on are set by the thread, and done is only read or
+ * set with lock held. */
+
+typedef struct save_job {
+   pthread_t thread;
+   pthread_mutex_t lock;
+   save_piece *pieces;
+   int npieces;
+   int piececap;
+   row_block *orphans;
+   int norphans;
+   int orphancap;
+   char *path;
+   int mode_mask;
+   int running;
+   int again;
+   int gen;
+   int mod;
+   int err;
+   long total;
+   int done;
+} save_job;
+
+/* a part of the mapping that a loader thread works through. first it
+ * counts the newlines in [from, to), then it puts down where the
+ * lines after them start, line being the first of those. later it
+ * lexes lines first .. first + nlines for the comment state each ends
+ * in, see load_lex. */
+
+typedef struct load_part {
+   pthread_t thread;
+   char *from;
+   char *to;
+   int line;
+   int newlines;
+   int cr;
+   int first;
+   int nlines;
+   unsigned char *alt;
+   int nalt;
+   int started;
+} load_part;
+
+/* the threads lexing a file that was just opened, for E.mapknown.
+ * done counts the parts they are through with, and is only read or
+ * set with lock held. */
+
+typedef struct load_job {
+   pthread_mutex_t lock;
+   load_part parts[LOAD_THREADS];
+   int nparts;
+   unsigned char *known;
+   int running;
+   int done;
+} load_job;
+
+/* one change to the text : at line, col the del bytes that follow
+ * the record were taken out and the ins bytes after them were put in.
+ * either may span lines, which are joined by '\n'. eof is set when an
+ * empty row was first added at the end for line, as when typing past
+ * the last line. cy, cx is where the cursor was before the change.
+ * records are laid out one after the other in the log, size bytes
+ * each, and prev is the size of the one before. */
+
+typedef struct undo_op {
+   int size;
+   int prev;
+   int group;
+   int line;
+   int col;
+   int del;
+   int ins;
+   int eof;
+   int cy;
+   int cx;
+} undo_op;
+
+/* the records before at are done and the ones from at on are undone,
+ * waiting to be redone. records that share a group are undone and
+ * redone together. open is set while the last record can still take
+ * in the next character typed or erased next to it. the log is kept
+ * under UNDO_LIMIT bytes by dropping its oldest groups. */
+
+typedef struct undo_log {
+   struct buffer log;
+   int at;
+   int last;
+   int group;
+   int grouping;
+   int open;
+   int lost;
+   int replaying;
+} undo_log;
+
+/* a timer set with timer_set, see the events section */
+
+typedef struct editor_timer {
+   struct editor_timer *next;
+   long due;
+   int armed;
+   void (*fn)();
+} editor_timer;
+
+/* a pipe, fifo or the like being read as its text comes in, see
+ * open_stream. len bytes of it have come in, out of room there is
+ * for, and the first lines of them are in the file. fd is -1 once it
+ * is all in, but rows made for its lines still shed what was worked
+ * out for them once they are off screen : top and shown are the lines
+ * that were on screen the last time. a file being followed keeps fd
+ * open at its end : waiting is set once it gets there, and then
+ * notify, an inotify descriptor with watch on the file, is what says
+ * there is more. off is how far into the file it has been read. */
+
+typedef struct stream_job {
+   int fd;
+   int shed;
+   int top;
+   int shown;
+   int lines;
+   int linecap;
+   int notify;
+   int watch;
+   int waiting;
+   size_t len;
+   size_t room;
+   off_t off;
+   editor_timer retry;
+} stream_job;
+
 struct editor_config {
    struct termios init_termios;
-   ed_row_data *rows_data;
+   line_node *store;
+   size_t *linestart;
    struct editor_syntax *syntax;
+   hl_keyword *kwtab;
+   unsigned int kwmask;
+   unsigned int kwseed;
+   int kwmax;
+   unsigned char cclass[256];
+   screen_frame frame;
+   screen_frame shown;
+   struct buffer out;
+   char inbuf[INPUT_RING];
+   unsigned int inhead;
+   unsigned int intail;
+   int shown_valid;
+   int shown_cy;
+   int shown_cx;
    char *filename;
+   char *map;
+   size_t maplen;
+   int mapfd;
+   int mapcr;
+   unsigned char *mapcomment;
+   unsigned char *mapknown;
    char status_extra[80];
-   time_t statis_extra_time;
+   search_query search;
+   match_index matches;
+   save_job save;
+   load_job load;
+   stream_job stream;
+   undo_log undo;
+   slab_pool nodepool;
+   slab_pool rowpool;
+   slab_pool textpool[ROW_CLASSES];
+   char *bigblocks;
+   char find_prompt[64];
+   int find_icase;
+   int find_regex;
+   int find_replace;
+   editor_timer status_timer;
+   editor_timer *wheel[TIMER_SLOTS];
+   long tick;
+   int ntimers;
+   int sigpipe[2];
    int numrows;
    int rows;
    int cols;
@@ -85,768 +530,4761 @@ struct editor_config {
    int rowoff;
    int coloff;
    int mod;
+   int hl_valid;
+   int hl_chain;
 } E;
 
 ssize_t getline(char** one, size_t* two, FILE* three);
 char    *strdup(const char *string);
-char* editor_prompt(char *prompt, void (*callback)(char*, int));
-void editor_update_hl(ed_row_data *row);
-
-/* row operations */
-
-int cx_to_rx(ed_row_data *row, int cx) {
-   int rx;
-   int j;
-   rx = 0;
-   for (j = 0; j < cx; j++) {
-      if (row->data[j] == '\t') rx += (TAB_STOP - 1) - (rx % TAB_STOP);
-      rx++;
+char* editor_prompt(char *prompt, int empty, void (*callback)(char*, int));
+void editor_update_hl(ed_row_data *row, int at);
+void editor_hl_done(ed_row_data *row, int at, int in_comment);
+void editor_hl_settle(int at, int changed);
+int line_comment_state(int at);
+void editor_hl_catch_up(int upto);
+void mark_hl_dirty(int at);
+void editor_hl_inserted(int at);
+void editor_hl_inserted_rows(int at, ed_row_data **rows, int n);
+void editor_hl_deleted(int at, int n);
+void editor_hl_changed(int at);
+int editor_idle();
+void timer_set(editor_timer *t, int ms, void (*fn)());
+void status_expire();
+void refresh_screen();
+void set_status_extra(const char *fmt, ...);
+void die(const char *s);
+int editor_highlight_span(ed_row_data *row, int at, int from, int to);
+char *row_text(ed_row_data *row);
+char *search_next_byte(char *p, char *end, int c);
+char *search_line(search_query *q, char *data, int size, char *from, int *len);
+void match_edit(int at, int removed, int added);
+int match_ordinal();
+int match_idle();
+void save_reap(int wait);
+int load_reap(int wait);
+void stream_read();
+void stream_shed();
+void follow_event();
+void save_editor();
+undo_op *undo_push(int line, int col, int del, int ins, int eof);
+char *undo_text(undo_op *op);
+void undo_typed(int c);
+void undo_erased(int line, int col, int c);
+void undo_inserted(char *s, int len, int raw);
+
+/* row memory */
+
+void *slab_alloc(slab_pool *p) {
+   char *block;
+   char *chunk;
+
+   if (p->free) {
+      block = p->free;
+      p->free = *(char**) block;
+      return block;
    }
-   return rx;
+   if (p->next == NULL || p->end - p->next < p->size) {
+      chunk = malloc(SLAB_CHUNK);
+      if (chunk == NULL) die("malloc");
+      *(char**) chunk = p->chunks;
+      p->chunks = chunk;
+      p->next = chunk + SLAB_HEADER;
+      p->end = chunk + SLAB_CHUNK;
+   }
+   block = p->next;
+   p->next += p->size;
+   return block;
 }
 
-int rx_to_cx(ed_row_data *row, int rx) {
-   int cx;
-   int rx_now;
-   rx_now = 0; 
-   for (cx = 0; cx < row->size; cx++) {
-      if (row->data[cx] == '\t') rx_now += (TAB_STOP - 1) - (rx_now % TAB_STOP);
-      rx_now++;
-      if (rx_now > rx) return cx;
-   }
-   return cx;
+void slab_free(slab_pool *p, void *block) {
+   *(char**) block = p->free;
+   p->free = block;
 }
 
-void editor_update_row(ed_row_data *row) {
-   int j;
-   int idx;
-   int tabs;
+/* lets go of every chunk of a pool, and so of all its blocks at once */
 
-   tabs = 0;
-   for (j = 0; j < row->size; j++) {
-      if (row->data[j] == '\t') tabs++;
-   }
-   
-   free(row->render);
-   row->render = malloc(row->size + tabs*(TAB_STOP - 1) + 1);
+void slab_pool_release(slab_pool *p) {
+   char *chunk;
 
-   idx = 0;
-   for (j = 0; j < row->size; j++) {
-      if (row->data[j] == '\t') {
-         row->render[idx++] = ' ';
-         while (idx % TAB_STOP != 0) row->render[idx++] = ' ';
-      } 
-      else row->render[idx++] = row->data[j];
+   while ((chunk = p->chunks) != NULL) {
+      p->chunks = *(char**) chunk;
+      free(chunk);
    }
-   row->render[idx] = '\0';
-   row->rensize = idx;
-   editor_update_hl(row);
+   p->free = NULL;
+   p->next = NULL;
+   p->end = NULL;
 }
 
-void editor_insert_row(int current, char *str, size_t len) {
-   int j;
-   
-   if (current < 0 || current > E.numrows) return;
+/* the size class a block of cap bytes comes from */
 
-   E.rows_data = realloc(E.rows_data, sizeof(ed_row_data) * (E.numrows + 1));
-   memmove(&E.rows_data[current+1], &E.rows_data[current], sizeof(ed_row_data) * (E.numrows - current));
-   for (j = current + 1; j <= E.numrows; j++) E.rows_data[j].idx++;
-
-   E.rows_data[current].idx = current;
-   E.rows_data[current].size = len;
-   E.rows_data[current].data = malloc(len + 1);
-   memcpy(E.rows_data[current].data, str, len);
-   E.rows_data[current].data[len] = '\0';
-
-   E.rows_data[current].rensize = 0;
-   E.rows_data[current].render = NULL;
-   E.rows_data[current].highlighted = NULL;
-   E.rows_data[current].comment_open = 0;
-   editor_update_row(&E.rows_data[current]);
-   
-   E.numrows++;
-   E.mod++;
+int row_class(int cap) {
+   int c;
+   int size;
+   for (c = 0, size = ROW_CLASS_MIN; size < cap; c++) size *= 2;
+   return c;
 }
 
-void editor_free_row(ed_row_data *row) {
-   free(row->highlighted);
-   free(row->render);
-   free(row->data);
-}
+/* the text, highlighting and tab blocks of rows come in powers of
+ * two up to ROW_CLASS_MAX, each size from a pool of its own. *cap is
+ * rounded up to the size of the block given back. bigger ones come
+ * from malloc, with SLAB_HEADER bytes in front that link them into
+ * E.bigblocks both ways, so that they too can all be let go of
+ * without looking through the rows. */
 
-void editor_del_row(int row_num) {
-   int j;
-   if (row_num < 0 || row_num >= E.numrows) return;
-   editor_free_row(&E.rows_data[row_num]);
-   memmove(
-      &E.rows_data[row_num], 
-      &E.rows_data[row_num + 1], 
-      sizeof(ed_row_data) * (E.numrows - row_num - 1)
-   );
-   for (j = row_num; j < E.numrows - 1; j++) E.rows_data[j].idx++;
-   E.numrows--;
-   E.mod++;
+char *row_alloc(int *cap) {
+   char **big;
+   int c;
+
+   if (*cap > ROW_CLASS_MAX) {
+      big = malloc(SLAB_HEADER + *cap);
+      if (big == NULL) die("malloc");
+      big[0] = NULL;
+      big[1] = E.bigblocks;
+      if (E.bigblocks) ((char**) E.bigblocks)[0] = (char*) big;
+      E.bigblocks = (char*) big;
+      return (char*) big + SLAB_HEADER;
+   }
+   c = row_class(*cap);
+   *cap = ROW_CLASS_MIN << c;
+   return slab_alloc(&E.textpool[c]);
 }
 
-void editor_append_to_row(ed_row_data *row, char *s, size_t len) {
-   row->data = realloc(row->data, row->size + len + 1);
-   memcpy(&row->data[row->size], s, len);
-   row->size += len;
-   row->data[row->size] = '\0';
-   editor_update_row(row);
-   E.mod++;
+void row_free(char *block, int cap) {
+   char **big;
+
+   if (block == NULL) return;
+   if (cap <= ROW_CLASS_MAX) {
+      slab_free(&E.textpool[row_class(cap)], block);
+      return;
+   }
+   big = (char**) (block - SLAB_HEADER);
+   if (big[0]) ((char**) big[0])[1] = big[1];
+   else E.bigblocks = big[1];
+   if (big[1]) ((char**) big[1])[0] = big[0];
+   free(big);
 }
 
-void editor_put_char_in_row(ed_row_data *row, int pos, int c) {
-   if (pos < 0 || pos > row->size) pos = row->size;
-   row->data = realloc(row->data, row->size + 2);
-   memmove(&row->data[pos+1], &row->data[pos], row->size - pos + 1);
-   row->size++;
-   row->data[pos] = c;
-   editor_update_row(row);
-   E.mod++;
+void slabs_init() {
+   int c;
+   memset(&E.nodepool, 0, sizeof(slab_pool));
+   memset(&E.rowpool, 0, sizeof(slab_pool));
+   memset(E.textpool, 0, sizeof(E.textpool));
+   E.nodepool.size = sizeof(line_node);
+   E.rowpool.size = sizeof(ed_row_data);
+   for (c = 0; c < ROW_CLASSES; c++) E.textpool[c].size = ROW_CLASS_MIN << c;
+   E.bigblocks = NULL;
 }
 
-/* editor operations */
+/* lets go of every row and node at once, in one free per chunk of the
+ * pools and per block too big for them. a save being written still
+ * reads the rows, so it is waited for. */
 
-void insert_char(int c) {
-   if (E.cy == E.numrows) editor_insert_row(E.numrows, "", 0);
-   editor_put_char_in_row(&E.rows_data[E.cy], E.cx, c);
-   E.cx++;
-} 
+void rows_free_all() {
+   char *big;
+   int c;
 
-void insert_newline() {
-   if (E.cx == 0) editor_insert_row(E.cy, "", 0);
-   else {
-      ed_row_data *row;
-      row = &E.rows_data[E.cy];
-      editor_insert_row(E.cy+1, &row->data[E.cx], row->size - E.cx);
-      row = &E.rows_data[E.cy];
-      row->size = E.cx;
-      row->data[row->size] = '\0';
-      editor_update_row(row);
+   save_reap(1);
+   slab_pool_release(&E.nodepool);
+   slab_pool_release(&E.rowpool);
+   for (c = 0; c < ROW_CLASSES; c++) slab_pool_release(&E.textpool[c]);
+   while ((big = E.bigblocks) != NULL) {
+      E.bigblocks = ((char**) big)[1];
+      free(big);
    }
-   E.cy++;
+   E.store = NULL;
+   E.numrows = 0;
    E.cx = 0;
+   E.cy = 0;
 }
 
-void editor_del_char_in_row(ed_row_data *row, int pos) {
-   if (pos < 0 || pos >= row->size) return;
-   memmove(&row->data[pos], &row->data[pos+1], row->size - pos);
-   row->size--;
-   editor_update_row(row);
-   E.mod++;
+/* line store */
+
+int node_count(line_node *n) {
+   return n ? n->count : 0;
 }
 
-void delete_char() {
-   ed_row_data *row;
-   
-   if (E.cy == E.numrows) return;
-   if (E.cx == 0 && E.cy == 0) return;
+void node_fix(line_node *n) {
+   n->count = node_count(n->left) + n->nlines + node_count(n->right);
+}
 
-   row = &E.rows_data[E.cy];
-   if (E.cx > 0) {
-      editor_del_char_in_row(row, E.cx-1);
-      E.cx--;
-   } else {
-      E.cx = E.rows_data[E.cy-1].size;
-      editor_append_to_row(&E.rows_data[E.cy-1], row->data, row->size);
-      editor_del_row(E.cy);
-      E.cy--;
+line_node *node_new(ed_row_data *row, int first, int nlines) {
+   line_node *n = slab_alloc(&E.nodepool);
+   n->left = NULL;
+   n->right = NULL;
+   n->prio = rand();
+   n->nlines = nlines;
+   n->first = first;
+   n->row = row;
+   node_fix(n);
+   return n;
+}
+
+line_node *rows_merge(line_node *a, line_node *b) {
+   if (a == NULL) return b;
+   if (b == NULL) return a;
+   if (a->prio > b->prio) {
+      a->right = rows_merge(a->right, b);
+      node_fix(a);
+      return a;
    }
+   b->left = rows_merge(a, b->left);
+   node_fix(b);
+   return b;
 }
 
-/* output */
+/* puts the first k lines of t in *l and the rest in *r, cutting a
+ * run in two if k falls inside it */
 
-void scroll_editor() {
-   E.rx = 0;
-   if (E.cy < E.numrows) E.rx = cx_to_rx(&E.rows_data[E.cy], E.cx);
+void rows_split(line_node *t, int k, line_node **l, line_node **r) {
+   int lc;
+   line_node *tail;
 
-   if (E.cy < E.rowoff) E.rowoff = E.cy;
-   if (E.cy >= E.rowoff + E.rows) E.rowoff = E.cy - E.rows + 1;
-   if (E.rx < E.coloff) E.coloff = E.rx;
-   if (E.rx >= E.coloff + E.cols) E.coloff = E.rx - E.cols + 1;
+   if (t == NULL) {
+      *l = NULL;
+      *r = NULL;
+      return;
+   }
+   lc = node_count(t->left);
+   if (k <= lc) {
+      rows_split(t->left, k, l, &t->left);
+      node_fix(t);
+      *r = t;
+   } else if (k >= lc + t->nlines) {
+      rows_split(t->right, k - lc - t->nlines, &t->right, r);
+      node_fix(t);
+      *l = t;
+   } else {
+      k -= lc;
+      tail = node_new(NULL, t->first + k, t->nlines - k);
+      t->nlines = k;
+      *r = rows_merge(tail, t->right);
+      t->right = NULL;
+      node_fix(t);
+      *l = t;
+   }
 }
 
-void draw_rows(struct buffer *buf) {
-   int y;
-   int padding;
- 
-   for (y = 0; y < E.rows; y++) {
-      int filerow;
-      filerow = y + E.rowoff;
-      if (filerow >= E.numrows) {
-         if (E.numrows == 0 && y == E.rows / 3) {
-            char welcome[80];
-            int welcomelen = snprintf(
-                welcome, 
-                sizeof(welcome),
-                "Olich editor -- version %s", OLICH_VERSION
-                );
-            if (welcomelen > E.cols) welcomelen = E.cols;
+/* finds the node holding line 'at' and the offset of it in there */
 
-            padding = (E.cols - welcomelen) / 2;
-            if (padding) {
-               buffer_append(buf, ".", 1);
-               padding --;
-            }
-            while (padding--) buffer_append(buf, " ", 1);
-            buffer_append(buf, welcome, welcomelen);
+line_node *rows_find(int at, int *off) {
+   line_node *n;
+   int lc;
 
-         } else {
-            buffer_append(buf, ".", 1);
-         }
+   n = E.store;
+   while (n) {
+      lc = node_count(n->left);
+      if (at < lc) n = n->left;
+      else if (at < lc + n->nlines) {
+         *off = at - lc;
+         return n;
       } else {
-         int len;
-         int j;
-         char* c;
-         unsigned char* hl;
-         int curcolor;
-         char sym;
-         
-         len = E.rows_data[filerow].rensize - E.coloff;
-         if (len < 0) len = 0;
-         if (len > E.cols)  len = E.cols;
-         curcolor = -1;
-         c = &E.rows_data[filerow].render[E.coloff];
-         hl = &E.rows_data[filerow].highlighted[E.coloff];
-
-         for (j = 0; j < len; j++) {
-            if (iscntrl(c[j])) {
-               sym = (c[j] <= 26) ? '@' + c[j] : '?';
-               buffer_append(buf, "\x1b[7m", 4);
-               buffer_append(buf, &sym, 1);
-               buffer_append(buf, "\x1b[m", 3);
-               if (curcolor != -1) {
-                  char nbuf[16];
-                  int clen;
-                  clen = snprintf(nbuf, sizeof(nbuf), "\x1b[%dm", curcolor);
-                  buffer_append(buf, nbuf, clen);
-               }
-            } else if (hl[j] == HL_NORMAL) {
-               if (curcolor != -1) { 
-                  buffer_append(buf, "\x1b[39m", 5);
-                  curcolor = -1;
-               }
-               buffer_append(buf, &c[j], 1);  
-            } else {
-               int color;
-               char cbuf[16];
-               int clen;
-               
-               color = hl_colors(hl[j]);
-               if (color != curcolor) {
-                  curcolor = color;
-                  clen = snprintf(cbuf, sizeof(cbuf), "\x1b[%dm", color);
-                  buffer_append(buf, cbuf, clen);
-               }
-               buffer_append(buf, &c[j], 1);
-            }
-         }
-         buffer_append(buf, "\x1b[39m", 5);
+         at -= lc + n->nlines;
+         n = n->right;
       }
-      buffer_append(buf, "\x1b[K", 3);
-      buffer_append(buf, "\r\n", 2);
    }
+   return NULL;
 }
 
-void draw_statusbar(struct buffer *buf) {
-   int len;
-   int rlen;
-   char l_status_info[80];
-   char r_status_info[80];
+/* text of line i of the mapping, without its line ending */
 
-   buffer_append(buf, "\x1b[7m", 4);
+char *map_line(int i, int *len) {
+   char *p;
+   int size;
 
-   len = snprintf(
-         l_status_info, 
-         sizeof(l_status_info),
-         "  %.20s %s  | %d lines |",
-         E.filename ? E.filename : "[No Name]",
-         E.mod ? "[+]" : "",
-         E.numrows
-   );
+   p = E.map + E.linestart[i];
+   size = E.linestart[i + 1] - E.linestart[i] - 1;
+   while (size > 0 && (p[size-1] == '\n' || p[size-1] == '\r')) size--;
+   *len = size;
+   return p;
+}
 
-   rlen = snprintf(
-         r_status_info, 
-         sizeof(r_status_info), 
-         " [ %s ] [ %d / %d ]",
-         E.syntax ? E.syntax->filetype : "text",
-         E.cy + 1,
-         E.numrows
-   ); 
+/* multi-line comment state at the end of mapping line i, as last
+ * computed by editor_hl_catch_up */
 
-   if (len > E.cols) len = E.cols;
-   buffer_append(buf, l_status_info, len);
+int map_comment(int i) {
+   return (E.mapcomment[i / 8] >> (i % 8)) & 1;
+}
 
-   while (len < E.cols) {
-      if (E.cols - len == rlen) {
-         buffer_append(buf, r_status_info, rlen);
-         break;
-      } else {
-         buffer_append(buf, " ", 1);
-         len++;
-      }
-   }
-   buffer_append(buf, "\x1b[m", 3);
-   buffer_append(buf, "\r\n", 2);
+void map_set_comment(int i, int state) {
+   if (state) E.mapcomment[i / 8] |= 1 << (i % 8);
+   else E.mapcomment[i / 8] &= ~(1 << (i % 8));
 }
 
-void draw_extra_bar(struct buffer *buf) {
-   int msglen;
-   buffer_append(buf, "\x1b[K", 3);
-   msglen = strlen(E.status_extra);
-   if (msglen > E.cols) msglen = E.cols;
-   if (msglen && time(NULL) - E.statis_extra_time < 5) {
-      buffer_append(buf, E.status_extra, msglen);
+/* comment state at the end of mapping line i in the file as it was
+ * loaded, once load_reap has it */
+
+int map_known(int i) {
+   return (E.mapknown[i / 8] >> (i % 8)) & 1;
+}
+
+char *line_peek(int at, int *len) {
+   line_node *n;
+   int off;
+
+   n = rows_find(at, &off);
+   if (n == NULL) return NULL;
+   if (n->row) {
+      *len = n->row->size;
+      return row_text(n->row);
    }
+   return map_line(n->first + off, len);
 }
 
-void refresh_screen() {
-   char cposbuf[32];
-   struct buffer buf = BUFFER_INIT;
+/* the row for line 'at', or NULL while it is still part of a run */
 
-   scroll_editor();
-   
-   buffer_append(&buf, "\x1b[?25l", 6);
-   buffer_append(&buf, "\x1b[H", 3);
-   draw_rows(&buf);   
-   draw_statusbar(&buf);
-   draw_extra_bar(&buf);
+ed_row_data *row_peek(int at) {
+   line_node *n;
+   int off;
+   n = rows_find(at, &off);
+   return n ? n->row : NULL;
+}
 
-   snprintf(cposbuf, sizeof(cposbuf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1 , (E.rx - E.coloff) + 1);
-   buffer_append(&buf, cposbuf, strlen(cposbuf));
+/* a view row for line i of the mapping */
 
-   buffer_append(&buf, "\x1b[?25h", 6);
-   write(STDOUT_FILENO, buf.data, buf.len);
-   buffer_free(&buf);
+ed_row_data *row_view(int i) {
+   ed_row_data *row;
+
+   row = slab_alloc(&E.rowpool);
+   row->data = map_line(i, &row->size);
+   row->gap = row->size;
+   row->cap = row->size;
+   row->tabs = 0;
+   row->tabcap = 0;
+   row->tabstop = NULL;
+   row->hl_upto = 0;
+   row->nmarks = 0;
+   row->markcap = 0;
+   row->marks = NULL;
+   row->highlighted = NULL;
+   row->comment_open = map_comment(i);
+   row->hl_dirty = 0;
+   row->view = 1;
+   row->frozen = 0;
+   return row;
 }
 
-void set_status_extra(const char *fmt, ...) {
-   va_list params;
-   va_start(params, fmt);
-   vsnprintf(
-      E.status_extra, 
-      sizeof(E.status_extra),
-      fmt, 
-      params 
-   );
-   va_end(params);
-   E.statis_extra_time = time(NULL);
+/* the row for line 'at', turning it into a view row first if it was
+ * part of a run */
+
+ed_row_data *row_at(int at) {
+   line_node *n;
+   line_node *l;
+   line_node *m;
+   line_node *r;
+   ed_row_data *row;
+   int off;
+
+   n = rows_find(at, &off);
+   if (n == NULL) return NULL;
+   if (n->row) return n->row;
+
+   row = row_view(n->first + off);
+   rows_split(E.store, at, &l, &r);
+   rows_split(r, 1, &m, &r);
+   m->row = row;
+   E.store = rows_merge(rows_merge(l, m), r);
+   return row;
 }
 
-/* terminal functions */
+void rows_insert(int at, ed_row_data *row) {
+   line_node *l;
+   line_node *r;
+   rows_split(E.store, at, &l, &r);
+   E.store = rows_merge(rows_merge(l, node_new(row, 0, 1)), r);
+   E.numrows = node_count(E.store);
+}
 
-void die(const char *s) {
-   write(STDOUT_FILENO, "\x1b[2J", 3);
-   write(STDOUT_FILENO, "\x1b[H", 3);
-   perror(s);
-   exit(1);
+/* puts n rows in at once : they are joined into a treap of their own
+ * first, so the store is only split and merged the one time */
+
+void rows_insert_many(int at, ed_row_data **rows, int n) {
+   line_node *l;
+   line_node *r;
+   line_node *m;
+   int i;
+
+   m = NULL;
+   for (i = 0; i < n; i++) m = rows_merge(m, node_new(rows[i], 0, 1));
+   rows_split(E.store, at, &l, &r);
+   E.store = rows_merge(rows_merge(l, m), r);
+   E.numrows = node_count(E.store);
 }
 
-void disable_raw() {
-   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.init_termios) == -1) die("tcsetattr");
+void rows_insert_run(int at, int first, int nlines) {
+   line_node *l;
+   line_node *r;
+   rows_split(E.store, at, &l, &r);
+   E.store = rows_merge(rows_merge(l, node_new(NULL, first, nlines)), r);
+   E.numrows = node_count(E.store);
 }
 
-void enable_raw() {
-   struct termios raw;
-   
-   if (tcgetattr(STDIN_FILENO, &E.init_termios) == -1) die("tcgetattr");
-   atexit(disable_raw);
-   raw = E.init_termios;
-  
-   /* setting the necessary terminal flags */
-   raw.c_iflag &= ~(IXON | ICRNL | INPCK | ISTRIP | BRKINT);
-   raw.c_oflag &= ~(OPOST);
-   raw.c_cflag |= (CS8);
-   raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
-   raw.c_cc[VMIN] = 0;
-   raw.c_cc[VTIME] = 1;
-  
-   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+/* unlinks line 'at' and returns its row so the caller can free it */
+
+ed_row_data *rows_remove(int at) {
+   line_node *l;
+   line_node *m;
+   line_node *r;
+   ed_row_data *row;
+
+   row = row_at(at);
+   rows_split(E.store, at, &l, &r);
+   rows_split(r, 1, &m, &r);
+   slab_free(&E.nodepool, m);
+   E.store = rows_merge(l, r);
+   E.numrows = node_count(E.store);
+   return row;
 }
 
-int read_key() {
-   int nread;
-   char c;
-   while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-      if (nread == -1 && errno != EAGAIN) die("read");
-   }
-
-   if (c == '\x1b') {
-      char seq[3];
-      if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-      if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-      if (seq[0] == '[') {
-         switch (seq[1]) {
-            case 'A': return ARROWU;
-            case 'B': return ARROWD;
-            case 'C': return ARROWR;
-            case 'D': return ARROWL;
-            case 'P': return DELETE;
-         }
+/* turns line 'at', whose row is a view that was never edited, back
+ * into line i of the mapping, as part of the run before or after it
+ * when it goes on from one */
+
+void rows_unview(int at, int i) {
+   line_node *l;
+   line_node *m;
+   line_node *r;
+   line_node *x;
+
+   rows_split(E.store, at, &l, &r);
+   rows_split(r, 1, &m, &r);
+   slab_free(&E.rowpool, m->row);
+   m->row = NULL;
+   m->first = i;
+   for (x = l; x && x->right; x = x->right);
+   if (x && x->row == NULL && x->first + x->nlines == i) {
+      x->nlines++;
+      for (x = l; x; x = x->right) x->count++;
+      slab_free(&E.nodepool, m);
+      m = NULL;
+   } else {
+      for (x = r; x && x->left; x = x->left);
+      if (x && x->row == NULL && x->first == i + 1) {
+         x->first--;
+         x->nlines++;
+         for (x = r; x; x = x->left) x->count++;
+         slab_free(&E.nodepool, m);
+         m = NULL;
       }
-      return '\x1b';
-   } 
-   else if (c == HOME_KEY) return HOME;
-   else if (c == END_KEY) return END;
-   else if (c == NEXTLINE) return ARROWD;
-   else if (c == PREVLINE) return ARROWU;
-   else {
-      return c;
    }
+   E.store = rows_merge(rows_merge(l, m), r);
 }
 
-int cursor_pos(int *rows, int *cols) {
-   char buf[32];
-   unsigned int i = 0;
+void rows_each_node(line_node *n, int at, void (*fn)(ed_row_data*, int)) {
+   while (n) {
+      rows_each_node(n->left, at, fn);
+      at += node_count(n->left);
+      if (n->row) fn(n->row, at);
+      at += n->nlines;
+      n = n->right;
+   }
+}
 
-   if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
-   
-   while (i < sizeof(buf) - 1) {
+/* calls fn on every line that is already a row, in order */
+
+void rows_each(void (*fn)(ed_row_data*, int)) {
+   rows_each_node(E.store, 0, fn);
+}
+
+/* row operations */
+
+/* an owned row keeps its text in a gap buffer : the text is
+ * data[0 .. gap) followed by data[gap + cap - size .. cap), so a run
+ * of edits at the same spot only moves the bytes in between. views
+ * have no gap ( gap == size == cap ). highlighted, once there is one,
+ * is laid out the same way and moves along with the text. */
+
+char row_char(ed_row_data *row, int i) {
+   return (i < row->gap) ? row->data[i] : row->data[i + row->cap - row->size];
+}
+
+void row_gap_to(ed_row_data *row, int pos) {
+   int gaplen = row->cap - row->size;
+   unsigned char *hl = row->highlighted;
+   if (pos < row->gap) {
+      memmove(&row->data[pos + gaplen], &row->data[pos], row->gap - pos);
+      if (hl) memmove(&hl[pos + gaplen], &hl[pos], row->gap - pos);
+   } else if (pos > row->gap) {
+      memmove(&row->data[row->gap], &row->data[row->gap + gaplen], pos - row->gap);
+      if (hl) memmove(&hl[row->gap], &hl[row->gap + gaplen], pos - row->gap);
+   }
+   row->gap = pos;
+}
+
+/* copies the size bytes of a gap buffer whose gap is at gap from a
+ * block of cap bytes to one of newcap bytes */
+
+void gap_copy(char *to, int newcap, char *from, int cap, int size, int gap) {
+   memcpy(to, from, gap);
+   memcpy(&to[newcap - (size - gap)], &from[cap - (size - gap)], size - gap);
+}
+
+void row_gap_reserve(ed_row_data *row, int n) {
+   char *data;
+   char *hl;
+   int cap;
+
+   if (row->cap - row->size >= n) return;
+   cap = row->cap * 2;
+   if (cap < row->size + n) cap = row->size + n;
+   data = row_alloc(&cap);
+   gap_copy(data, cap, row->data, row->cap, row->size, row->gap);
+   if (row->highlighted) {
+      hl = row_alloc(&cap);
+      gap_copy(hl, cap, (char*) row->highlighted, row->cap, row->size, row->gap);
+      row_free((char*) row->highlighted, row->cap);
+      row->highlighted = (unsigned char*) hl;
+   }
+   row_free(row->data, row->cap);
+   row->data = data;
+   row->cap = cap;
+}
+
+/* makes text[from .. to) one stretch, moving the gap out of it by
+ * the shorter way if it is inside, and returns the offset at which
+ * the stretch lies in data and highlighted */
+
+int row_span(ed_row_data *row, int from, int to) {
+   if (from < row->gap && row->gap < to) {
+      row_gap_to(row, (row->gap - from < to - row->gap) ? from : to);
+   }
+   return (from < row->gap) ? 0 : row->cap - row->size;
+}
+
+/* closes the gap and returns the text, nul terminated unless the
+ * row is still a view */
+
+char *row_text(ed_row_data *row) {
+   if (row->view) return row->data;
+   row_gap_to(row, row->size);
+   row->data[row->size] = '\0';
+   return row->data;
+}
+
+/* a rendered row has highlighted, one byte for every byte of its
+ * text, and its text is drawn as is apart from the tabs. those are
+ * kept in a table : tabstop[2k] is where the k-th tab is in the text
+ * and tabstop[2k + 1] the screen column right after it, so columns
+ * are found by a binary search over the tabs. */
+
+/* grows a table of int pairs kept in a row block to hold n pairs,
+ * keeping the first keep of them */
+
+int *pairs_reserve(int *pairs, int *cap, int n, int keep) {
+   int *bigger;
+   int size;
+
+   if ((int) (n * 2 * sizeof(int)) <= *cap) return pairs;
+   size = *cap ? *cap * 2 : (int) (8 * sizeof(int));
+   if (size < (int) (n * 2 * sizeof(int))) size = n * 2 * sizeof(int);
+   bigger = (int*) row_alloc(&size);
+   if (pairs) {
+      memcpy(bigger, pairs, keep * 2 * sizeof(int));
+      row_free((char*) pairs, *cap);
+   }
+   *cap = size;
+   return bigger;
+}
+
+/* the number of tabs before cx */
+
+int row_tabs_before(ed_row_data *row, int cx) {
+   int lo;
+   int hi;
+   int mid;
+
+   lo = 0;
+   hi = row->tabs;
+   while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (row->tabstop[2 * mid] < cx) lo = mid + 1;
+      else hi = mid;
+   }
+   return lo;
+}
+
+/* makes the tab table of a row, looking at the text on both sides of
+ * the gap */
+
+void row_index_tabs(ed_row_data *row) {
+   char *text;
+   char *p;
+   int side;
+   int end;
+   int k;
+   int cx;
+   int rx;
+
+   k = 0;
+   cx = 0;
+   rx = 0;
+   for (side = 0; side < 2; side++) {
+      text = side ? row->data + row->cap - row->size : row->data;
+      end = side ? row->size : row->gap;
+      while (cx < end && (p = memchr(&text[cx], '\t', end - cx)) != NULL) {
+         rx += p - text - cx;
+         cx = p - text;
+         row->tabstop = pairs_reserve(row->tabstop, &row->tabcap, k + 1, k);
+         rx += TAB_STOP - (rx % TAB_STOP);
+         row->tabstop[2*k] = cx;
+         row->tabstop[2*k + 1] = rx;
+         k++;
+         cx++;
+      }
+      rx += end - cx;
+      cx = end;
+   }
+   row->tabs = k;
+}
+
+/* brings the tab table up to date after ins bytes took the place of
+ * del bytes at pos : the tabs among them are looked for again, and
+ * the ones behind them move along. past the first of those, every
+ * tab moves by the same number of columns. */
+
+void row_tabs_edit(ed_row_data *row, int pos, int ins, int del) {
+   int *t;
+   int first;
+   int last;
+   int added;
+   int shift;
+   int rx;
+   int j;
+   int k;
+
+   first = row_tabs_before(row, pos);
+   last = row_tabs_before(row, pos + del);
+   added = 0;
+   for (j = pos; j < pos + ins; j++) {
+      if (row_char(row, j) == '\t') added++;
+   }
+   if (first == row->tabs && added == 0) return;
+
+   row->tabstop = pairs_reserve(row->tabstop, &row->tabcap, row->tabs - (last - first) + added, row->tabs);
+   t = row->tabstop;
+   memmove(&t[2 * (first + added)], &t[2 * last], (row->tabs - last) * 2 * sizeof(int));
+   row->tabs += added - (last - first);
+
+   rx = first ? t[2*first - 1] + pos - t[2*first - 2] - 1 : pos;
+   k = first;
+   for (j = pos; j < pos + ins; j++) {
+      if (row_char(row, j) == '\t') {
+         rx += TAB_STOP - (rx % TAB_STOP);
+         t[2*k] = j;
+         t[2*k + 1] = rx;
+         k++;
+      } else rx++;
+   }
+   if (k == row->tabs) return;
+   rx += t[2*k] + ins - del - (pos + ins);
+   rx += TAB_STOP - (rx % TAB_STOP);
+   shift = rx - t[2*k + 1];
+   for (; k < row->tabs; k++) {
+      t[2*k] += ins - del;
+      t[2*k + 1] += shift;
+   }
+}
+
+int cx_to_rx(ed_row_data *row, int cx) {
+   int rx;
+   int j;
+   int k;
+
+   if (row->highlighted) {
+      if (row->tabs == 0) return cx;
+      k = row_tabs_before(row, cx);
+      return k ? row->tabstop[2*k - 1] + cx - row->tabstop[2*k - 2] - 1 : cx;
+   }
+   rx = 0;
+   for (j = 0; j < cx; j++) {
+      if (row_char(row, j) == '\t') rx += (TAB_STOP - 1) - (rx % TAB_STOP);
+      rx++;
+   }
+   return rx;
+}
+
+int rx_to_cx(ed_row_data *row, int rx) {
+   int cx;
+   int rx_now;
+   int lo;
+   int hi;
+   int mid;
+
+   if (row->highlighted) {
+      /* the first lo tabs end at or before rx */
+      lo = 0;
+      hi = row->tabs;
+      while (lo < hi) {
+         mid = (lo + hi) / 2;
+         if (row->tabstop[2*mid + 1] <= rx) lo = mid + 1;
+         else hi = mid;
+      }
+      cx = lo ? row->tabstop[2*lo - 2] + 1 + rx - row->tabstop[2*lo - 1] : rx;
+      if (lo < row->tabs && cx > row->tabstop[2*lo]) cx = row->tabstop[2*lo];
+      return (cx < row->size) ? cx : row->size;
+   }
+   rx_now = 0; 
+   for (cx = 0; cx < row->size; cx++) {
+      if (row_char(row, cx) == '\t') rx_now += (TAB_STOP - 1) - (rx_now % TAB_STOP);
+      rx_now++;
+      if (rx_now > rx) return cx;
+   }
+   return cx;
+}
+
+/* rows longer than LEX_CHUNK are lexed only as far as they are on
+ * screen : highlighted is good up to hl_upto, and every LEX_CHUNK
+ * bytes or so the lexer leaves a mark, marks[2k] being where it was
+ * and marks[2k + 1] its state there ( -1 in a comment, -2 in one
+ * that runs to the end of the line, else the quote of the string it
+ * is in, 1 in the middle of a word, or 0 ). an edit is lexed again from the mark before it at
+ * worst, and only up to the edge of the screen unless it settles
+ * earlier, so typing costs the same however long the line is. the
+ * comment state at the end of such a row is left to
+ * editor_hl_catch_up. */
+
+int row_horizon(ed_row_data *row) {
+   int cx;
+   if (row->size <= LEX_CHUNK) return row->size;
+   cx = rx_to_cx(row, E.coloff + E.cols) + 1;
+   return (cx < row->size) ? cx : row->size;
+}
+
+/* index of the last mark at or before pos, or -1 */
+
+int row_mark_before(ed_row_data *row, int pos) {
+   int lo;
+   int hi;
+   int mid;
+
+   lo = 0;
+   hi = row->nmarks;
+   while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (row->marks[2 * mid] <= pos) lo = mid + 1;
+      else hi = mid;
+   }
+   return lo - 1;
+}
+
+/* records the lexer state at pos as mark k, in the place of the
+ * marks from k on that are not past pos */
+
+void row_mark_put(ed_row_data *row, int k, int pos, int state) {
+   int j;
+
+   for (j = k; j < row->nmarks && row->marks[2*j] <= pos; j++);
+   if (j == k) {
+      row->marks = pairs_reserve(row->marks, &row->markcap, row->nmarks + 1, row->nmarks);
+      row->nmarks++;
+   } else {
+      row->nmarks -= j - k - 1;
+   }
+   memmove(&row->marks[2 * (k + 1)], &row->marks[2 * j], (row->nmarks - k - 1) * 2 * sizeof(int));
+   row->marks[2*k] = pos;
+   row->marks[2*k + 1] = state;
+}
+
+/* drops the marks from k on that come before pos */
+
+void row_marks_drop(ed_row_data *row, int k, int pos) {
+   int j;
+
+   for (j = k; j < row->nmarks && row->marks[2*j] < pos; j++);
+   if (j == k) return;
+   memmove(&row->marks[2*k], &row->marks[2*j], (row->nmarks - j) * 2 * sizeof(int));
+   row->nmarks -= j - k;
+}
+
+/* moves hl_upto and the marks along with an edit at pos */
+
+void row_marks_edit(ed_row_data *row, int pos, int ins, int del) {
+   int k;
+
+   if (row->hl_upto >= pos + del) row->hl_upto += ins - del;
+   else if (row->hl_upto > pos) row->hl_upto = pos;
+   for (k = row_mark_before(row, pos) + 1; k < row->nmarks; k++) {
+      if (row->marks[2*k] >= pos + del) row->marks[2*k] += ins - del;
+      else row->marks[2*k] = pos;
+   }
+}
+
+void editor_update_row(ed_row_data *row, int at) {
+   int cap;
+
+   if (row->highlighted == NULL) {
+      cap = row->cap;
+      row->highlighted = (unsigned char*) row_alloc(&cap);
+   }
+   row_index_tabs(row);
+   editor_update_hl(row, at);
+}
+
+/* brings highlighted and the tab table up to date after the text at
+ * pos was replaced : ins bytes now sit where del bytes used to be.
+ * the highlighting around them moved with the gap already, and so
+ * only the new bytes and what they change are lexed. */
+
+void editor_patch_row(ed_row_data *row, int at, int pos, int ins, int del) {
+   if (row->highlighted == NULL) {
+      editor_update_row(row, at);
+      if (row->hl_upto < row->size) editor_hl_changed(at);
+      match_edit(at, 1, 1);
+      return;
+   }
+
+   row_tabs_edit(row, pos, ins, del);
+   row_marks_edit(row, pos, ins, del);
+   if (pos > row->hl_upto + LEX_CHUNK || editor_highlight_span(row, at, pos, pos + ins)) {
+      editor_hl_changed(at);
+   }
+   match_edit(at, 1, 1);
+}
+
+/* rows loaded through open_mapped start out as views : data points
+ * into the file mapping and highlighted is NULL. a view is rendered
+ * the first time it is drawn and copied the first time it
+ * is edited. rows inserted while editing are not rendered up front
+ * either, and highlighting that went stale is only redone here. */
+
+void editor_materialize_row(ed_row_data *row, int at) {
+   editor_hl_catch_up(at);
+   if (row->highlighted == NULL) editor_update_row(row, at);
+   else if (row->hl_dirty) editor_update_hl(row, at);
+   else if (row->hl_upto < row_horizon(row)) editor_highlight_span(row, at, row->hl_upto, row->hl_upto);
+}
+
+/* whether a background save still reads the text of row */
+
+int row_frozen(ed_row_data *row) {
+   return E.save.running && row->frozen == E.save.gen;
+}
+
+/* lets go of the text of a row, leaving it to the save if it is
+ * frozen */
+
+void row_release(ed_row_data *row) {
+   row_block *orphan;
+
+   if (row->view) return;
+   if (!row_frozen(row)) {
+      row_free(row->data, row->cap);
+      return;
+   }
+   if (E.save.norphans == E.save.orphancap) {
+      E.save.orphancap = E.save.orphancap ? E.save.orphancap * 2 : 64;
+      E.save.orphans = realloc(E.save.orphans, E.save.orphancap * sizeof(row_block));
+   }
+   orphan = &E.save.orphans[E.save.norphans++];
+   orphan->data = row->data;
+   orphan->cap = row->cap;
+}
+
+/* gives the row a text of its own before it is changed : views are
+ * copied out of the mapping, and frozen rows out of the save. neither
+ * has a gap */
+
+void editor_own_row(ed_row_data *row) {
+   char *data;
+   char *hl;
+   int cap;
+   if (!row->view && !row_frozen(row)) return;
+   cap = row->size + 1;
+   data = row_alloc(&cap);
+   memcpy(data, row->data, row->size);
+   data[row->size] = '\0';
+   if (row->highlighted) {
+      hl = row_alloc(&cap);
+      memcpy(hl, row->highlighted, row->size);
+      row_free((char*) row->highlighted, row->cap);
+      row->highlighted = (unsigned char*) hl;
+   }
+   row_release(row);
+   row->frozen = 0;
+   row->data = data;
+   row->cap = cap;
+   row->gap = row->size;
+   row->view = 0;
+}
+
+ed_row_data *editor_new_row(char *str, size_t len) {
+   ed_row_data *row;
+
+   row = slab_alloc(&E.rowpool);
+   row->size = len;
+   row->gap = len;
+   row->cap = len + 1;
+   row->data = row_alloc(&row->cap);
+   memcpy(row->data, str, len);
+   row->data[len] = '\0';
+
+   row->tabs = 0;
+   row->tabcap = 0;
+   row->tabstop = NULL;
+   row->hl_upto = 0;
+   row->nmarks = 0;
+   row->markcap = 0;
+   row->marks = NULL;
+   row->highlighted = NULL;
+   row->comment_open = 0;
+   row->hl_dirty = 0;
+   row->view = 0;
+   row->frozen = 0;
+   return row;
+}
+
+void editor_insert_row(int current, char *str, size_t len) {
+   ed_row_data *row;
+   
+   if (current < 0 || current > E.numrows) return;
+
+   row = editor_new_row(str, len);
+   row->comment_open = line_comment_state(current - 1);
+   rows_insert(current, row);
+   editor_hl_inserted(current);
+   match_edit(current, 0, 1);
+   
+   E.mod++;
+}
+
+/* lets go of all that was worked out from the text of a row, which
+ * editor_materialize_row works out again when it is needed */
+
+void row_shed(ed_row_data *row) {
+   row_free((char*) row->highlighted, row->cap);
+   row_free((char*) row->tabstop, row->tabcap);
+   row_free((char*) row->marks, row->markcap);
+   row->highlighted = NULL;
+   row->tabstop = NULL;
+   row->marks = NULL;
+   row->tabs = 0;
+   row->tabcap = 0;
+   row->nmarks = 0;
+   row->markcap = 0;
+   row->hl_upto = 0;
+}
+
+void editor_free_row(ed_row_data *row) {
+   row_shed(row);
+   row_release(row);
+   slab_free(&E.rowpool, row);
+}
+
+void editor_del_row(int row_num) {
+   if (row_num < 0 || row_num >= E.numrows) return;
+   editor_free_row(rows_remove(row_num));
+   editor_hl_deleted(row_num, 1);
+   match_edit(row_num, 1, 0);
+   E.mod++;
+}
+
+void rows_free(line_node *n) {
+   if (n == NULL) return;
+   rows_free(n->left);
+   rows_free(n->right);
+   if (n->row) editor_free_row(n->row);
+   slab_free(&E.nodepool, n);
+}
+
+/* takes out the n lines from at on with a single split of the line
+ * store */
+
+void editor_del_rows(int at, int n) {
+   line_node *l;
+   line_node *m;
+   line_node *r;
+
+   if (n <= 0) return;
+   rows_split(E.store, at, &l, &r);
+   rows_split(r, n, &m, &r);
+   rows_free(m);
+   E.store = rows_merge(l, r);
+   E.numrows = node_count(E.store);
+   editor_hl_deleted(at, n);
+   match_edit(at, n, 0);
+   E.mod++;
+}
+
+void editor_append_to_row(int at, char *s, size_t len) {
+   ed_row_data *row = row_at(at);
+   int pos;
+   editor_own_row(row);
+   row_gap_reserve(row, len + 1);
+   row_gap_to(row, row->size);
+   pos = row->size;
+   memcpy(&row->data[pos], s, len);
+   row->gap += len;
+   row->size += len;
+   editor_patch_row(row, at, pos, len, 0);
+   E.mod++;
+}
+
+/* puts ins[0 .. inslen) in the place of the dellen bytes at pos. a
+ * row that is not rendered is left that way, and is
+ * only lexed again once it is drawn */
+
+void editor_splice_row(int at, int pos, int dellen, char *ins, int inslen) {
+   ed_row_data *row = row_at(at);
+   editor_own_row(row);
+   row_gap_reserve(row, inslen + 1);
+   row_gap_to(row, pos + dellen);
+   row->gap -= dellen;
+   row->size -= dellen;
+   if (inslen > 0) memcpy(&row->data[row->gap], ins, inslen);
+   row->gap += inslen;
+   row->size += inslen;
+   if (row->highlighted) editor_patch_row(row, at, pos, inslen, dellen);
+   else {
+      editor_hl_changed(at);
+      match_edit(at, 1, 1);
+   }
+   E.mod++;
+}
+
+void editor_put_char_in_row(int at, int pos, int c) {
+   ed_row_data *row = row_at(at);
+   if (pos < 0 || pos > row->size) pos = row->size;
+   editor_own_row(row);
+   row_gap_reserve(row, 2);
+   row_gap_to(row, pos);
+   row->data[row->gap++] = c;
+   row->size++;
+   editor_patch_row(row, at, pos, 1, 0);
+   E.mod++;
+}
+
+/* editor operations */
+
+void insert_char(int c) {
+   undo_typed(c);
+   if (E.cy == E.numrows) editor_insert_row(E.numrows, "", 0);
+   editor_put_char_in_row(E.cy, E.cx, c);
+   E.cx++;
+} 
+
+void insert_newline() {
+   undo_op *op;
+   if ((op = undo_push(E.cy, E.cx, 0, E.cy < E.numrows, E.cy == E.numrows)) != NULL) {
+      if (op->ins) undo_text(op)[0] = '\n';
+   }
+   if (E.cx == 0) editor_insert_row(E.cy, "", 0);
+   else {
+      ed_row_data *row;
+      char *tail;
+      int len;
+      row = row_at(E.cy);
+      editor_own_row(row);
+      row_gap_to(row, E.cx);
+      tail = &row->data[row->gap + row->cap - row->size];
+      len = row->size - E.cx;
+      editor_insert_row(E.cy+1, tail, len);
+      row->size = E.cx;
+      editor_patch_row(row, E.cy, E.cx, 0, len);
+   }
+   E.cy++;
+   E.cx = 0;
+}
+
+/* length of the line at the start of s[0 .. len), and in *next where
+ * the line after it starts. \r\n, \r and \n all end a line, since
+ * terminals paste line breaks as \r, unless raw is set : then only \n
+ * does, as in the text kept by undo. */
+
+int text_line(char *s, int len, int *next, int raw) {
+   int i;
+   for (i = 0; i < len && s[i] != '\n' && (raw || s[i] != '\r'); i++);
+   *next = i;
+   if (i < len) (*next)++;
+   if (!raw && i < len && s[i] == '\r' && i + 1 < len && s[i + 1] == '\n') (*next)++;
+   return i;
+}
+
+/* inserts s[0 .. len) at the cursor as one edit : the current row is
+ * cut and patched once, and all the lines after the first are made
+ * into rows and put in with a single split of the line store. raw is
+ * passed on to text_line */
+
+void insert_text(char *s, int len, int raw) {
+   ed_row_data *row;
+   ed_row_data **rows;
+   char *tail;
+   char *last;
+   int taillen;
+   int seglen;
+   int next;
+   int nrows;
+   int n;
+   int i;
+
+   if (len == 0) return;
+   undo_inserted(s, len, raw);
+   if (E.cy == E.numrows) editor_insert_row(E.numrows, "", 0);
+   row = row_at(E.cy);
+   editor_own_row(row);
+   seglen = text_line(s, len, &next, raw);
+
+   if (next == len && seglen == len) {
+      row_gap_reserve(row, len + 1);
+      row_gap_to(row, E.cx);
+      memcpy(&row->data[row->gap], s, len);
+      row->gap += len;
+      row->size += len;
+      editor_patch_row(row, E.cy, E.cx, len, 0);
+      E.cx += len;
+      E.mod++;
+      return;
+   }
+
+   /* the first line replaces the text after the cursor, which goes to
+    * the end of the last one */
+   row_gap_to(row, E.cx);
+   taillen = row->size - E.cx;
+   tail = malloc(taillen + 1);
+   memcpy(tail, &row->data[row->gap + row->cap - row->size], taillen);
+   row->size = E.cx;
+   row_gap_reserve(row, seglen + 1);
+   memcpy(&row->data[row->gap], s, seglen);
+   row->gap += seglen;
+   row->size += seglen;
+   editor_patch_row(row, E.cy, E.cx, seglen, taillen);
+
+   nrows = 1;
+   for (i = next; i < len; i += n) {
+      text_line(&s[i], len - i, &n, raw);
+      nrows++;
+   }
+   rows = malloc(nrows * sizeof(ed_row_data*));
+   nrows = 0;
+   for (i = next; i < len; i += n) {
+      seglen = text_line(&s[i], len - i, &n, raw);
+      if (i + n == len && seglen == n) break;
+      rows[nrows++] = editor_new_row(&s[i], seglen);
+   }
+   seglen = (i < len) ? len - i : 0;
+   last = malloc(seglen + taillen + 1);
+   memcpy(last, &s[len - seglen], seglen);
+   memcpy(&last[seglen], tail, taillen);
+   rows[nrows++] = editor_new_row(last, seglen + taillen);
+   free(last);
+   free(tail);
+
+   rows_insert_many(E.cy + 1, rows, nrows);
+   editor_hl_inserted_rows(E.cy + 1, rows, nrows);
+   match_edit(E.cy + 1, 0, nrows);
+   free(rows);
+   E.cy += nrows;
+   E.cx = seglen;
+   E.mod++;
+}
+
+void editor_del_char_in_row(int at, int pos) {
+   ed_row_data *row = row_at(at);
+   if (pos < 0 || pos >= row->size) return;
+   editor_own_row(row);
+   row_gap_to(row, pos + 1);
+   row->gap--;
+   row->size--;
+   editor_patch_row(row, at, pos, 0, 1);
+   E.mod++;
+}
+
+void delete_char() {
+   ed_row_data *row;
+   
+   if (E.cy == E.numrows) return;
+   if (E.cx == 0 && E.cy == 0) return;
+
+   row = row_at(E.cy);
+   if (E.cx > 0) {
+      undo_erased(E.cy, E.cx-1, row_char(row, E.cx-1));
+      editor_del_char_in_row(E.cy, E.cx-1);
+      E.cx--;
+   } else {
+      undo_erased(E.cy-1, row_at(E.cy-1)->size, '\n');
+      E.cx = row_at(E.cy-1)->size;
+      editor_append_to_row(E.cy-1, row_text(row), row->size);
+      editor_del_row(E.cy);
+      E.cy--;
+   }
+}
+
+/* undo */
+
+undo_op *undo_rec(int off) {
+   return (undo_op*) &E.undo.log.data[off];
+}
+
+char *undo_text(undo_op *op) {
+   return (char*) (op + 1);
+}
+
+/* bytes taken by a record holding n bytes of text */
+
+int undo_size(int n) {
+   return (sizeof(undo_op) + n + sizeof(int) - 1) & ~(sizeof(int) - 1);
+}
+
+/* offset of the record that ends at off, or -1 if there is none */
+
+int undo_back(int off) {
+   if (off == 0) return -1;
+   if (off == E.undo.log.len) return E.undo.last;
+   return off - undo_rec(off)->prev;
+}
+
+void undo_clear() {
+   E.undo.log.len = 0;
+   E.undo.at = 0;
+   E.undo.last = -1;
+   E.undo.open = 0;
+}
+
+/* makes room for n more bytes at the end of the log, dropping the
+ * oldest groups but never the current one. when that is not enough,
+ * the whole log goes, since none of it would apply to the text any
+ * more, and -1 is returned */
+
+int undo_reserve(int n) {
+   undo_log *u;
+   int off;
+   int group;
+
+   u = &E.undo;
+   if (u->log.len + n > UNDO_LIMIT) {
+      off = 0;
+      while (off < u->log.len && u->log.len - off + n > UNDO_LIMIT - UNDO_LIMIT / 4) {
+         group = undo_rec(off)->group;
+         if (group == u->group) break;
+         while (off < u->log.len && undo_rec(off)->group == group) off += undo_rec(off)->size;
+      }
+      if (u->log.len - off + n > UNDO_LIMIT) {
+         undo_clear();
+         u->lost = 1;
+         return -1;
+      }
+      memmove(u->log.data, &u->log.data[off], u->log.len - off);
+      u->log.len -= off;
+      u->at -= off;
+      u->last = (u->log.len > 0) ? u->last - off : -1;
+      if (u->log.len > 0) undo_rec(0)->prev = 0;
+   }
+   if (buffer_reserve(&u->log, n) == -1) {
+      undo_clear();
+      u->lost = 1;
+      return -1;
+   }
+   return 0;
+}
+
+/* adds a record of a change at line, col that takes out del bytes and
+ * puts in ins, and returns it for the caller to fill in its text.
+ * what was undone can no longer be redone. returns NULL while undo or
+ * redo is replaying the log, and once a group could not be kept */
+
+undo_op *undo_push(int line, int col, int del, int ins, int eof) {
+   undo_log *u;
+   undo_op *op;
+   int size;
+
+   u = &E.undo;
+   if (u->replaying) return NULL;
+   u->open = 0;
+   if (!u->grouping) {
+      u->group++;
+      u->lost = 0;
+   }
+   if (u->lost) return NULL;
+
+   if (u->at < u->log.len) {
+      u->last = undo_back(u->at);
+      u->log.len = u->at;
+   }
+   size = undo_size(del + ins);
+   if (undo_reserve(size) == -1) return NULL;
+   op = undo_rec(u->log.len);
+   op->size = size;
+   op->prev = (u->last >= 0) ? u->log.len - u->last : 0;
+   op->group = u->group;
+   op->line = line;
+   op->col = col;
+   op->del = del;
+   op->ins = ins;
+   op->eof = eof;
+   op->cy = E.cy;
+   op->cx = E.cx;
+   u->last = u->log.len;
+   u->log.len += size;
+   u->at = u->log.len;
+   return op;
+}
+
+/* the last record, if it is still open to more of what it holds */
+
+undo_op *undo_open() {
+   undo_log *u = &E.undo;
+   if (!u->open || u->replaying || u->at != u->log.len || u->last < 0) return NULL;
+   return undo_rec(u->last);
+}
+
+/* makes the text of the last record n bytes longer, or shorter when n
+ * is negative */
+
+undo_op *undo_grow(int n) {
+   undo_log *u;
+   undo_op *op;
+   int size;
+
+   u = &E.undo;
+   op = undo_rec(u->last);
+   size = undo_size(op->del + op->ins + n);
+   if (size > op->size) {
+      if (undo_reserve(size - op->size) == -1) return NULL;
+      op = undo_rec(u->last);
+   }
+   u->log.len += size - op->size;
+   u->at = u->log.len;
+   op->size = size;
+   return op;
+}
+
+/* typing is one change for as long as the characters follow each
+ * other on a line */
+
+void undo_typed(int c) {
+   undo_op *op;
+
+   op = undo_open();
+   if (op && op->del == 0 && op->line == E.cy && op->col + op->ins == E.cx) {
+      if ((op = undo_grow(1)) == NULL) return;
+      undo_text(op)[op->ins++] = c;
+      return;
+   }
+   if ((op = undo_push(E.cy, E.cx, 0, 1, E.cy == E.numrows)) == NULL) return;
+   undo_text(op)[0] = c;
+   E.undo.open = 1;
+}
+
+/* c is taken out at line, col. erasing the last character typed takes
+ * it out of the change that put it in, and erasing backwards or
+ * forwards from where the last erase was makes that one larger */
+
+void undo_erased(int line, int col, int c) {
+   undo_log *u;
+   undo_op *op;
+   char *text;
+
+   u = &E.undo;
+   op = undo_open();
+   if (op && c != '\n' && op->line == line) {
+      if (op->del == 0 && op->ins > 0 && op->col + op->ins == col + 1) {
+         op = undo_grow(-1);
+         if (--op->ins > 0) return;
+         u->open = 0;
+         if (op->eof) return;
+         u->log.len = u->last;
+         u->at = u->log.len;
+         u->last = op->prev ? u->last - op->prev : -1;
+         return;
+      }
+      if (op->ins == 0 && !op->eof && (op->col == col + 1 || op->col == col)) {
+         if ((op = undo_grow(1)) == NULL) return;
+         text = undo_text(op);
+         if (op->col == col) text[op->del] = c;
+         else {
+            memmove(&text[1], text, op->del);
+            text[0] = c;
+            op->col--;
+         }
+         op->del++;
+         return;
+      }
+   }
+   if ((op = undo_push(line, col, 1, 0, 0)) == NULL) return;
+   undo_text(op)[0] = c;
+   E.undo.open = (c != '\n');
+}
+
+/* records text put in at the cursor, with its line breaks as '\n' */
+
+void undo_inserted(char *s, int len, int raw) {
+   undo_op *op;
+   char *p;
+   int size;
+   int seg;
+   int n;
+   int i;
+
+   if (E.undo.replaying) return;
+   size = 0;
+   for (i = 0; i < len; i += n) {
+      seg = text_line(&s[i], len - i, &n, raw);
+      size += seg + (n > seg);
+   }
+   if ((op = undo_push(E.cy, E.cx, 0, size, E.cy == E.numrows)) == NULL) return;
+   p = undo_text(op);
+   for (i = 0; i < len; i += n) {
+      seg = text_line(&s[i], len - i, &n, raw);
+      memcpy(p, &s[i], seg);
+      p += seg;
+      if (n > seg) *p++ = '\n';
+   }
+}
+
+/* changes recorded between undo_begin and undo_end are one group */
+
+void undo_begin() {
+   E.undo.group++;
+   E.undo.lost = 0;
+   E.undo.grouping = 1;
+}
+
+void undo_end() {
+   E.undo.grouping = 0;
+}
+
+/* takes the len bytes s out at line, col, in one go however many
+ * lines they span. eof takes out the row they were put in too. */
+
+void undo_take(int line, int col, char *s, int len, int eof) {
+   static struct buffer tail = BUFFER_INIT;
+   char *text;
+   char *nl;
+   char *p;
+   int first;
+   int size;
+   int k;
+
+   k = 0;
+   first = len;
+   for (p = s; (nl = memchr(p, '\n', s + len - p)) != NULL; p = nl + 1) {
+      if (k++ == 0) first = nl - s;
+   }
+   if (eof) {
+      editor_del_rows(line, k + 1);
+      return;
+   }
+   if (k == 0) {
+      if (len > 0) editor_splice_row(line, col, len, "", 0);
+      return;
+   }
+   text = line_peek(line + k, &size);
+   tail.len = 0;
+   buffer_append(&tail, &text[s + len - p], size - (s + len - p));
+   editor_del_rows(line + 1, k);
+   editor_splice_row(line, col, first, tail.data, tail.len);
+}
+
+/* puts the len bytes s in at line, col, after adding a row at the
+ * end for it if eof is set */
+
+void undo_put(int line, int col, char *s, int len, int eof) {
+   if (eof) editor_insert_row(E.numrows, "", 0);
+   if (len == 0) return;
+   if (memchr(s, '\n', len) == NULL) {
+      editor_splice_row(line, col, 0, s, len);
+      return;
+   }
+   E.cy = line;
+   E.cx = col;
+   insert_text(s, len, 1);
+}
+
+/* undoes one record, or redoes it, and puts the cursor where it was
+ * before the change or after it */
+
+void undo_apply(undo_op *op, int redo) {
+   char *del;
+   char *ins;
+   char *out;
+   char *in;
+   char *nl;
+   int outlen;
+   int inlen;
+
+   del = undo_text(op);
+   ins = del + op->del;
+   out = redo ? del : ins;
+   outlen = redo ? op->del : op->ins;
+   in = redo ? ins : del;
+   inlen = redo ? op->ins : op->del;
+   if (op->eof || memchr(out, '\n', outlen) || memchr(in, '\n', inlen)) {
+      undo_take(op->line, op->col, out, outlen, op->eof && !redo);
+      undo_put(op->line, op->col, in, inlen, op->eof && redo);
+   } else {
+      editor_splice_row(op->line, op->col, outlen, in, inlen);
+   }
+   if (!redo) {
+      E.cy = op->cy;
+      E.cx = op->cx;
+      return;
+   }
+   E.cy = op->line;
+   E.cx = op->col + op->ins;
+   for (nl = ins; (nl = memchr(nl, '\n', ins + op->ins - nl)) != NULL; nl++) {
+      E.cy++;
+      E.cx = ins + op->ins - nl - 1;
+   }
+}
+
+/* undoes the last group of changes that is done, or redoes the first
+ * one that was undone */
+
+void undo_editor(int redo) {
+   undo_log *u;
+   int group;
+   int off;
+
+   u = &E.undo;
+   u->open = 0;
+   off = redo ? u->at : undo_back(u->at);
+   if (off < 0 || off == u->log.len) {
+      set_status_extra(redo ? "Nothing to redo" : "Nothing to undo");
+      return;
+   }
+   group = undo_rec(off)->group;
+   u->replaying = 1;
+   if (redo) {
+      while (u->at < u->log.len && undo_rec(u->at)->group == group) {
+         undo_apply(undo_rec(u->at), 1);
+         u->at += undo_rec(u->at)->size;
+      }
+   } else {
+      while (off >= 0 && undo_rec(off)->group == group) {
+         undo_apply(undo_rec(off), 0);
+         u->at = off;
+         off = undo_back(off);
+      }
+   }
+   u->replaying = 0;
+}
+
+/* output */
+
+void scroll_editor() {
+   E.rx = 0;
+   if (E.cy < E.numrows) E.rx = cx_to_rx(row_at(E.cy), E.cx);
+
+   if (E.cy < E.rowoff) E.rowoff = E.cy;
+   if (E.cy >= E.rowoff + E.rows) E.rowoff = E.cy - E.rows + 1;
+   if (E.rx < E.coloff) E.coloff = E.rx;
+   if (E.rx >= E.coloff + E.cols) E.coloff = E.rx - E.cols + 1;
+}
+
+/* the screen is composed into E.frame and then compared line by line
+ * with E.shown, the frame that was last written out. only the columns
+ * between the first and the last cell that differ are sent, so a key
+ * that changes nothing but the cursor position costs a single cursor
+ * move. the output goes through E.out, which is kept between frames. */
+
+void frame_clear_line(int y) {
+   memset(&E.frame.chars[y * E.cols], ' ', E.cols);
+   memset(&E.frame.attrs[y * E.cols], 0, E.cols);
+}
+
+/* colors every match of the search on a row drawn len columns wide.
+ * only the text on screen is searched, along with as much on either
+ * side as a match can reach into it from : the length of the query,
+ * or for a pattern a screen's width, which is as far as one is found
+ * whole. the gap is only moved out of that stretch, never closed. */
+
+void draw_matches(ed_row_data *row, unsigned char *attrs, int len) {
+   search_query *q;
+   char *text;
+   char *p;
+   int reach;
+   int lo;
+   int hi;
+   int from;
+   int to;
+   int mlen;
+
+   q = &E.search;
+   reach = q->regex ? E.cols : q->len - 1;
+   lo = rx_to_cx(row, E.coloff) - reach;
+   hi = rx_to_cx(row, E.coloff + len) + 1 + reach;
+   if (lo < 0) lo = 0;
+   if (hi > row->size) hi = row->size;
+
+   /* the byte before the stretch tells whether it starts a line */
+   text = row->data + row_span(row, lo ? lo - 1 : 0, hi);
+   for (p = text + lo; (p = search_line(q, text, hi, p, &mlen)) != NULL; p += mlen) {
+      from = cx_to_rx(row, p - text) - E.coloff;
+      to = cx_to_rx(row, p - text + mlen) - E.coloff;
+      if (from < 0) from = 0;
+      if (to > len) to = len;
+      if (from < to) memset(&attrs[from], hl_colors(HL_MATCH), to - from);
+      if (from >= len) break;
+   }
+}
+
+void draw_rows() {
+   int y;
+   int padding;
+   char *chars;
+   unsigned char *attrs;
+ 
+   if (E.stream.shed) stream_shed();
+   for (y = 0; y < E.rows; y++) {
+      int filerow;
+      filerow = y + E.rowoff;
+      frame_clear_line(y);
+      chars = &E.frame.chars[y * E.cols];
+      attrs = &E.frame.attrs[y * E.cols];
+      if (filerow >= E.numrows) {
+         chars[0] = '.';
+         if (E.numrows == 0 && y == E.rows / 3) {
+            char welcome[80];
+            int welcomelen = snprintf(
+                welcome, 
+                sizeof(welcome),
+                "Olich editor -- version %s", OLICH_VERSION
+                );
+            if (welcomelen > E.cols) welcomelen = E.cols;
+
+            padding = (E.cols - welcomelen) / 2;
+            memcpy(&chars[padding], welcome, welcomelen);
+         }
+      } else {
+         int len;
+         int j;
+         int k;
+         int n;
+         int cx;
+         int rx;
+         int end;
+         int last;
+         int off;
+         ed_row_data *row;
+         char *text;
+         char *tab;
+         unsigned char *hl;
+         int color;
+         
+         row = row_at(filerow);
+         editor_materialize_row(row, filerow);
+         if (y == E.rows - 1) {
+            for (j = filerow + 1; j <= filerow + HL_LOOKAHEAD && j < E.numrows; j++) {
+               editor_materialize_row(row_at(j), j);
+            }
+         }
+
+         /* the highlighting goes into attrs as is, and is turned into
+          * colors once the line is laid out. plain runs are copied
+          * straight from the text and tabs are drawn as spaces. only
+          * the columns on screen are looked at */
+         cx = rx_to_cx(row, E.coloff);
+         rx = cx_to_rx(row, cx);
+         last = rx_to_cx(row, E.coloff + E.cols);
+         if (last < row->size) last++;
+         off = row_span(row, cx, last);
+         text = row->data + off;
+         hl = row->highlighted + off;
+         len = 0;
+         while (cx < last && len < E.cols) {
+            if (text[cx] == '\t') {
+               end = rx + TAB_STOP - (rx % TAB_STOP);
+               n = end - ((rx > E.coloff) ? rx : E.coloff);
+               if (n > E.cols - len) n = E.cols - len;
+               memset(&chars[len], ' ', n);
+               memset(&attrs[len], hl[cx], n);
+               len += n;
+               rx = end;
+               cx++;
+               continue;
+            }
+            tab = row->tabs ? memchr(&text[cx], '\t', last - cx) : NULL;
+            n = (tab ? tab - text : last) - cx;
+            if (n > E.cols - len) n = E.cols - len;
+            memcpy(&chars[len], &text[cx], n);
+            memcpy(&attrs[len], &hl[cx], n);
+            len += n;
+            rx += n;
+            cx += n;
+         }
+         for (j = 0; j < len; j = k) {
+            k = j + 1;
+            while (k < len && attrs[k] == attrs[j]) k++;
+            color = (attrs[j] == HL_NORMAL) ? 0 : hl_colors(attrs[j]);
+            memset(&attrs[j], color, k - j);
+         }
+         if (E.search.valid && E.search.len) draw_matches(row, attrs, len);
+         for (j = 0; j < len; j++) {
+            if (iscntrl(chars[j])) {
+               chars[j] = (chars[j] <= 26) ? '@' + chars[j] : '?';
+               attrs[j] |= CELL_INVERSE;
+            }
+         }
+      }
+   }
+}
+
+void draw_statusbar() {
+   int len;
+   int rlen;
+   int n;
+   char l_status_info[80];
+   char r_status_info[80];
+   char matches[40];
+   char reading[40];
+   char *more;
+   char *chars;
+
+   matches[0] = '\0';
+   reading[0] = '\0';
+   if (E.stream.notify != -1) snprintf(reading, sizeof(reading), " following, %lu bytes |", (unsigned long) E.stream.len);
+   else if (E.stream.fd != -1) snprintf(reading, sizeof(reading), " %lu bytes so far |", (unsigned long) E.stream.len);
+   if (E.search.valid && E.search.len) {
+      n = match_ordinal();
+      more = (E.matches.scanned < E.numrows) ? "+" : "";
+      if (n) snprintf(matches, sizeof(matches), " [ match %d of %d%s ]", n, E.matches.total, more);
+      else snprintf(matches, sizeof(matches), " [ %d%s matches ]", E.matches.total, more);
+   }
+
+   len = snprintf(
+         l_status_info, 
+         sizeof(l_status_info),
+         "  %.20s %s  | %d lines |%s",
+         E.filename ? E.filename : "[No Name]",
+         E.mod ? "[+]" : "",
+         E.numrows,
+         reading
+   );
+
+   rlen = snprintf(
+         r_status_info, 
+         sizeof(r_status_info), 
+         "%s [ %s ] [ %d / %d ]",
+         matches,
+         E.syntax ? E.syntax->filetype : "text",
+         E.cy + 1,
+         E.numrows
+   ); 
+
+   if (len > E.cols) len = E.cols;
+   chars = &E.frame.chars[E.rows * E.cols];
+   memset(chars, ' ', E.cols);
+   memset(&E.frame.attrs[E.rows * E.cols], CELL_INVERSE, E.cols);
+   memcpy(chars, l_status_info, len);
+   if (E.cols - len >= rlen) memcpy(&chars[E.cols - rlen], r_status_info, rlen);
+}
+
+void draw_extra_bar() {
+   int msglen;
+
+   frame_clear_line(E.rows + 1);
+   msglen = strlen(E.status_extra);
+   if (msglen > E.cols) msglen = E.cols;
+   if (msglen) {
+      memcpy(&E.frame.chars[(E.rows + 1) * E.cols], E.status_extra, msglen);
+   }
+}
+
+void emit_attr(struct buffer *buf, int *cur, int attr) {
+   char abuf[16];
+   int alen;
+
+   if (*cur == attr) return;
+   alen = snprintf(abuf, sizeof(abuf), "\x1b[0%s", (attr & CELL_INVERSE) ? ";7" : "");
+   if (attr & ~CELL_INVERSE) {
+      alen += snprintf(&abuf[alen], sizeof(abuf) - alen, ";%d", attr & ~CELL_INVERSE);
+   }
+   abuf[alen++] = 'm';
+   buffer_append(buf, abuf, alen);
+   *cur = attr;
+}
+
+int frame_line_changed(int y) {
+   int at;
+
+   at = y * E.cols;
+   return !E.shown_valid ||
+      memcmp(&E.frame.chars[at], &E.shown.chars[at], E.cols) ||
+      memcmp(&E.frame.attrs[at], &E.shown.attrs[at], E.cols);
+}
+
+/* appends what it takes to turn screen line y from E.shown into
+ * E.frame. cells are sent in runs of the same attribute, each with
+ * one escape sequence in front of it. */
+
+void emit_line(struct buffer *buf, int y, int *cur) {
+   char *nc;
+   char *oc;
+   unsigned char *na;
+   unsigned char *oa;
+   char pbuf[32];
+   int plen;
+   int first;
+   int last;
+   int end;
+   int clear;
+   int x;
+   int k;
+
+   nc = &E.frame.chars[y * E.cols];
+   na = &E.frame.attrs[y * E.cols];
+   oc = &E.shown.chars[y * E.cols];
+   oa = &E.shown.attrs[y * E.cols];
+
+   end = E.cols;
+   while (end > 0 && nc[end-1] == ' ' && na[end-1] == 0) end--;
+
+   first = 0;
+   last = E.cols - 1;
+   clear = 1;
+   if (E.shown_valid) {
+      /* bytes of a multibyte character do not take a column each, so
+       * such lines are always sent from the start */
+      for (x = 0; x < E.cols; x++) {
+         if ((unsigned char) nc[x] >= 0x80 || (unsigned char) oc[x] >= 0x80) break;
+      }
+      if (x == E.cols) {
+         while (nc[first] == oc[first] && na[first] == oa[first]) first++;
+         while (nc[last] == oc[last] && na[last] == oa[last]) last--;
+         clear = (last >= end);
+      }
+   }
+   if (clear) last = end - 1;
+
+   plen = snprintf(pbuf, sizeof(pbuf), "\x1b[%d;%dH", y + 1, first + 1);
+   buffer_append(buf, pbuf, plen);
+   for (x = first; x <= last; x = k) {
+      k = x + 1;
+      while (k <= last && na[k] == na[x]) k++;
+      emit_attr(buf, cur, na[x]);
+      buffer_append(buf, &nc[x], k - x);
+   }
+   if (clear) {
+      emit_attr(buf, cur, 0);
+      buffer_append(buf, "\x1b[K", 3);
+   }
+}
+
+void refresh_screen() {
+   char cposbuf[32];
+   screen_frame swap;
+   int lines;
+   int changed;
+   int cur;
+   int cy;
+   int cx;
+   int y;
+
+   scroll_editor();
+   
+   draw_rows();   
+   draw_statusbar();
+   draw_extra_bar();
+
+   E.out.len = 0;
+   lines = E.rows + 2;
+   changed = 0;
+   cur = 0;
+   for (y = 0; y < lines; y++) {
+      if (!frame_line_changed(y)) continue;
+      if (!changed) buffer_append(&E.out, "\x1b[?25l", 6);
+      emit_line(&E.out, y, &cur);
+      changed = 1;
+   }
+   emit_attr(&E.out, &cur, 0);
+
+   cy = (E.cy - E.rowoff) + 1;
+   cx = (E.rx - E.coloff) + 1;
+   if (changed || !E.shown_valid || cy != E.shown_cy || cx != E.shown_cx) {
+      snprintf(cposbuf, sizeof(cposbuf), "\x1b[%d;%dH", cy, cx);
+      buffer_append(&E.out, cposbuf, strlen(cposbuf));
+   }
+   if (changed) buffer_append(&E.out, "\x1b[?25h", 6);
+   if (E.out.len) write(STDOUT_FILENO, E.out.data, E.out.len);
+
+   swap = E.shown;
+   E.shown = E.frame;
+   E.frame = swap;
+   E.shown_valid = 1;
+   E.shown_cy = cy;
+   E.shown_cx = cx;
+}
+
+void set_status_extra(const char *fmt, ...) {
+   va_list params;
+   va_start(params, fmt);
+   vsnprintf(
+      E.status_extra, 
+      sizeof(E.status_extra),
+      fmt, 
+      params 
+   );
+   va_end(params);
+   timer_set(&E.status_timer, STATUS_TIMEOUT, status_expire);
+}
+
+/* terminal functions */
+
+void die(const char *s) {
+   write(STDOUT_FILENO, "\x1b[2J", 3);
+   write(STDOUT_FILENO, "\x1b[H", 3);
+   perror(s);
+   exit(1);
+}
+
+void disable_raw() {
+   write(STDOUT_FILENO, "\x1b[?2004l", 8);
+   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.init_termios) == -1) die("tcsetattr");
+}
+
+void enable_raw() {
+   struct termios raw;
+   
+   if (tcgetattr(STDIN_FILENO, &E.init_termios) == -1) die("tcgetattr");
+   atexit(disable_raw);
+   raw = E.init_termios;
+  
+   /* setting the necessary terminal flags */
+   raw.c_iflag &= ~(IXON | ICRNL | INPCK | ISTRIP | BRKINT);
+   raw.c_oflag &= ~(OPOST);
+   raw.c_cflag |= (CS8);
+   raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+   raw.c_cc[VMIN] = 0;
+   raw.c_cc[VTIME] = 0;
+  
+   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+   /* pastes come wrapped in ESC [ 200 ~ and ESC [ 201 ~ */
+   write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+/* events */
+
+long now_ms() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/* timers hang in a wheel of TIMER_SLOTS lists, one for every
+ * TIMER_TICK ms, each in the list of the tick it is due in. a timer
+ * due more than a turn away stays in its list until the wheel comes
+ * around to it again. */
+
+void timer_cancel(editor_timer *t) {
+   editor_timer **p;
+
+   if (!t->armed) return;
+   for (p = &E.wheel[t->due % TIMER_SLOTS]; *p != t; p = &(*p)->next);
+   *p = t->next;
+   t->armed = 0;
+   E.ntimers--;
+}
+
+void timer_set(editor_timer *t, int ms, void (*fn)()) {
+   timer_cancel(t);
+   t->due = (now_ms() + ms + TIMER_TICK - 1) / TIMER_TICK;
+   if (t->due < E.tick) t->due = E.tick;
+   t->fn = fn;
+   t->next = E.wheel[t->due % TIMER_SLOTS];
+   E.wheel[t->due % TIMER_SLOTS] = t;
+   t->armed = 1;
+   E.ntimers++;
+}
+
+/* ms until the next timer is due, or -1 if there is none */
+
+int timer_next() {
+   editor_timer *t;
+   long due;
+   long ms;
+   int i;
+
+   if (E.ntimers == 0) return -1;
+   due = -1;
+   for (i = 0; i < TIMER_SLOTS; i++) {
+      for (t = E.wheel[i]; t; t = t->next) {
+         if (due == -1 || t->due < due) due = t->due;
+      }
+   }
+   ms = due * TIMER_TICK - now_ms();
+   return (ms < 0) ? 0 : ms;
+}
+
+/* runs the timers that are due. they are unlinked first, so they can
+ * set themselves or others again */
+
+void timers_run() {
+   editor_timer *due;
+   editor_timer *t;
+   editor_timer **p;
+   long now;
+   long tick;
+
+   now = now_ms() / TIMER_TICK;
+   if (E.ntimers == 0) {
+      E.tick = now + 1;
+      return;
+   }
+   due = NULL;
+   for (tick = E.tick; tick <= now && tick < E.tick + TIMER_SLOTS; tick++) {
+      p = &E.wheel[tick % TIMER_SLOTS];
+      while ((t = *p) != NULL) {
+         if (t->due > now) {
+            p = &t->next;
+            continue;
+         }
+         *p = t->next;
+         t->armed = 0;
+         t->next = due;
+         due = t;
+         E.ntimers--;
+      }
+   }
+   E.tick = now + 1;
+   while ((t = due) != NULL) {
+      due = t->next;
+      t->fn();
+   }
+}
+
+void handle_winch(int sig) {
+   int saved = errno;
+   (void) sig;
+   write(E.sigpipe[1], "", 1);
+   errno = saved;
+}
+
+/* sizes the screen planes for a terminal of rows by cols */
+
+void frames_alloc(int rows, int cols) {
+   E.frame.chars = realloc(E.frame.chars, rows * cols);
+   E.frame.attrs = realloc(E.frame.attrs, rows * cols);
+   E.shown.chars = realloc(E.shown.chars, rows * cols);
+   E.shown.attrs = realloc(E.shown.attrs, rows * cols);
+   E.shown_valid = 0;
+}
+
+void editor_resize() {
+   struct winsize ws;
+
+   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0 || ws.ws_row < 3) return;
+   if (ws.ws_row == E.rows + 2 && ws.ws_col == E.cols) return;
+   frames_alloc(ws.ws_row, ws.ws_col);
+   E.rows = ws.ws_row - 2;
+   E.cols = ws.ws_col;
+   refresh_screen();
+}
+
+/* waits for input for up to timeout ms, or for as long as it takes
+ * when timeout is -1, though then the loader threads being done ends
+ * the wait too, so that their work is picked up while idle. resizes
+ * and timers are dealt with while waiting ; any number of SIGWINCH
+ * that came in together make for one resize. returns whether there
+ * is input to be read. */
+
+int editor_wait(int timeout) {
+   struct pollfd fds[3];
+   char drain[64];
+   long end;
+   int wait;
+   int left;
+   int n;
+
+   end = now_ms() + timeout;
+   while (1) {
+      timers_run();
+      wait = timer_next();
+      if (timeout >= 0) {
+         left = end - now_ms();
+         if (left < 0) left = 0;
+         if (wait == -1 || left < wait) wait = left;
+      }
+      fds[0].fd = STDIN_FILENO;
+      fds[0].events = POLLIN;
+      fds[1].fd = E.sigpipe[0];
+      fds[1].events = POLLIN;
+      fds[2].fd = E.stream.waiting ? E.stream.notify : E.stream.fd;
+      fds[2].events = POLLIN;
+      n = poll(fds, 3, wait);
+      if (n == -1 && errno != EINTR) die("poll");
+      if (n > 0 && fds[1].revents) {
+         while (read(E.sigpipe[0], drain, sizeof(drain)) > 0);
+         editor_resize();
+         save_reap(0);
+         if (load_reap(0) && timeout < 0) return 0;
+      }
+      if (n > 0 && fds[2].revents) {
+         if (E.stream.waiting) follow_event();
+         else stream_read();
+         refresh_screen();
+      }
+      if (n > 0 && fds[0].revents) return 1;
+      if (timeout >= 0 && now_ms() >= end) return 0;
+   }
+}
+
+void status_expire() {
+   E.status_extra[0] = '\0';
+   refresh_screen();
+}
+
+/* input is read into a ring of INPUT_RING bytes, as much as is there
+ * at a time, and keys are decoded from it. inhead and intail count
+ * the bytes ever put in and taken out. */
+
+int input_fill() {
+   unsigned int at;
+   unsigned int room;
+   int nread;
+
+   at = E.inhead & (INPUT_RING - 1);
+   room = INPUT_RING - (E.inhead - E.intail);
+   if (room > INPUT_RING - at) room = INPUT_RING - at;
+   if (room == 0) return 0;
+   nread = read(STDIN_FILENO, &E.inbuf[at], room);
+   if (nread == -1 && errno != EAGAIN) die("read");
+   if (nread <= 0) return 0;
+   E.inhead += nread;
+   return nread;
+}
+
+/* whether a key can be read without waiting for one */
+
+int input_pending() {
+   return E.inhead != E.intail || input_fill() > 0;
+}
+
+/* waits for n bytes to be in the ring, giving each of them
+ * ESC_TIMEOUT ms to arrive */
+
+int input_wait(unsigned int n) {
+   while (E.inhead - E.intail < n) {
+      if (input_fill() == 0 && !editor_wait(ESC_TIMEOUT)) return 0;
+   }
+   return 1;
+}
+
+char input_peek(unsigned int i) {
+   return E.inbuf[(E.intail + i) & (INPUT_RING - 1)];
+}
+
+/* reads the text of a bracketed paste into paste, a ring full at a
+ * time, up to the ESC [ 201 ~ that closes it. what came in after that
+ * is given back to the ring. */
+
+void read_paste(struct buffer *paste) {
+   char *p;
+   unsigned int at;
+   int from;
+   int last;
+   int len;
+   int i;
+
+   from = 0;
+   while (1) {
+      if (E.inhead == E.intail && input_fill() == 0) {
+         if (!editor_wait(PASTE_TIMEOUT)) return;
+         continue;
+      }
+      at = E.intail & (INPUT_RING - 1);
+      len = E.inhead - E.intail;
+      if (len > INPUT_RING - (int) at) len = INPUT_RING - at;
+      buffer_append(paste, &E.inbuf[at], len);
+      E.intail += len;
+
+      /* the marker may have been split across reads, so every place
+       * it could still start at is looked at again next time */
+      last = paste->len - PASTE_END_LEN;
+      for (i = from; i <= last; i++) {
+         if ((p = memchr(&paste->data[i], PASTE_END[0], last - i + 1)) == NULL) break;
+         i = p - paste->data;
+         if (!memcmp(p, PASTE_END, PASTE_END_LEN)) {
+            E.intail -= paste->len - i - PASTE_END_LEN;
+            paste->len = i;
+            return;
+         }
+      }
+      if (from <= last) from = last + 1;
+   }
+}
+
+/* the key for an escape sequence, whose ESC has been taken already.
+ * modifiers ( ESC [ 1 ; 5 C and the like ) are left out, so they act
+ * like the key without them. a lone ESC stays an ESC, and sequences
+ * that are not known are dropped. */
+
+int read_escape() {
+   char intro;
+   char c;
+   int num;
+   int more;
+   unsigned int i;
+
+   if (!input_wait(1)) return '\x1b';
+   intro = input_peek(0);
+   if (intro != '[' && intro != 'O') return '\x1b';
+   if (!input_wait(2)) return '\x1b';
+
+   /* past the first parameter only the final byte matters */
+   num = 0;
+   more = 0;
+   for (i = 1; i < ESC_SEQ_MAX; i++) {
+      if (!input_wait(i + 1)) return '\x1b';
+      c = input_peek(i);
+      if (c < '0' || c > ';') break;
+      if (c > '9') more = 1;
+      else if (!more && num < 1000) num = num * 10 + c - '0';
+   }
+
+   /* one that goes on without a final byte is dropped, as far as it
+    * was read, and taken for a plain escape */
+   if (i == ESC_SEQ_MAX) {
+      E.intail += i;
+      return '\x1b';
+   }
+   E.intail += i + 1;
+
+   switch (c) {
+      case 'A': return ARROWU;
+      case 'B': return ARROWD;
+      case 'C': return ARROWR;
+      case 'D': return ARROWL;
+      case 'H': return HOME;
+      case 'F': return END;
+      case 'P': if (intro == '[') return DELETE; break;
+      case '~':
+         switch (num) {
+            case 1: case 7: return HOME;
+            case 4: case 8: return END;
+            case 3: return DELETE;
+            case 5: return PAGEUP;
+            case 6: return PAGEDOWN;
+            case 200: return PASTE;
+         }
+   }
+   return '\x1b';
+}
+
+int read_key() {
+   char c;
+   while (E.inhead == E.intail && input_fill() == 0) editor_wait(editor_idle() ? 0 : -1);
+   c = input_peek(0);
+   E.intail++;
+
+   if (c == '\x1b') return read_escape();
+   else if (c == HOME_KEY) return HOME;
+   else if (c == END_KEY) return END;
+   else if (c == NEXTLINE) return ARROWD;
+   else if (c == PREVLINE) return ARROWU;
+   else {
+      return c;
+   }
+}
+
+int cursor_pos(int *rows, int *cols) {
+   char buf[32];
+   unsigned int i = 0;
+
+   if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
+   
+   while (i < sizeof(buf) - 1) {
       if (read(STDIN_FILENO, &buf[i], 1) != 1) break; 
       if (buf[i] == 'R') break;
       i++;
    }
 
-   buf[i] = '\0';
+   buf[i] = '\0';
+
+   if (buf[0] != '\x1b' || buf[1] != '[') return -1;
+   if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) return -1;
+   return 0;
+}
+
+int term_size(int *rows, int *cols) {
+   struct winsize ws;
+   
+   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+      if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
+      read_key();
+      return cursor_pos(rows, cols);
+   } else {
+      *cols = ws.ws_col;
+      *rows = ws.ws_row;
+      return 0;
+   }
+}
+
+/* syntax highlighting */
+
+int is_separator(int c) {
+   return E.cclass[(unsigned char) c] & CC_SEP;
+}
+
+/* fills E.cclass for the selected syntax. the highlighter dispatches on
+ * these instead of testing a character against each rule in turn :
+ * CC_SCS and CC_MCS mark the first byte of the comment delimiters, and
+ * CC_WORD marks whatever can only ever be plain text in the middle of
+ * a word. */
+
+void build_char_classes() {
+   int c;
+   char *scs;
+   char *mcs;
+   char *mce;
+
+   for (c = 0; c < 256; c++) {
+      E.cclass[c] = 0;
+      if (isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL) E.cclass[c] |= CC_SEP;
+      if (isdigit(c)) E.cclass[c] |= CC_DIGIT;
+   }
+   if (E.syntax) {
+      scs = E.syntax->sl_cmt_start;
+      mcs = E.syntax->ml_cmt_start;
+      mce = E.syntax->ml_cmt_end;
+      if (E.syntax->flags & HL_STRINGS) {
+         E.cclass['"'] |= CC_QUOTE;
+         E.cclass['\''] |= CC_QUOTE;
+      }
+      if (scs && scs[0]) E.cclass[(unsigned char) scs[0]] |= CC_SCS;
+      if (mcs && mcs[0] && mce && mce[0]) E.cclass[(unsigned char) mcs[0]] |= CC_MCS;
+   }
+   for (c = 0; c < 256; c++) {
+      if (!(E.cclass[c] & (CC_SEP | CC_QUOTE | CC_SCS | CC_MCS))) E.cclass[c] |= CC_WORD;
+   }
+}
+
+unsigned int keyword_hash(char *s, int len, unsigned int seed) {
+   unsigned int h;
+   int i;
+
+   h = 2166136261u ^ seed;
+   for (i = 0; i < len; i++) h = (h ^ (unsigned char) s[i]) * 16777619u;
+   return h;
+}
+
+/* builds E.kwtab for the selected syntax. keywords go in before
+ * datatypes, so a word listed as both stays a keyword. words are
+ * looked up as whole tokens, so they cannot contain separators. */
+
+void build_keyword_table() {
+   char **lists[2];
+   int kinds[2];
+   unsigned int size;
+   unsigned int seed;
+   unsigned int slot;
+   int n;
+   int k;
+   int j;
+   int len;
+   int ok;
+
+   lists[0] = E.syntax->keyword;
+   lists[1] = E.syntax->datatypes;
+   kinds[0] = HL_KEYWORD;
+   kinds[1] = HL_DATATYPE;
+
+   n = 0;
+   for (k = 0; k < 2; k++) {
+      for (j = 0; lists[k][j]; j++) n++;
+   }
+   size = 4;
+   while (size < 4 * (unsigned int) n) size *= 2;
+
+   free(E.kwtab);
+   seed = 0;
+   for (;;) {
+      E.kwtab = calloc(size, sizeof(hl_keyword));
+      E.kwmax = 0;
+      ok = 1;
+      for (k = 0; k < 2 && ok; k++) {
+         for (j = 0; lists[k][j] && ok; j++) {
+            len = strlen(lists[k][j]);
+            slot = keyword_hash(lists[k][j], len, seed) & (size - 1);
+            if (E.kwtab[slot].word == NULL) {
+               E.kwtab[slot].word = lists[k][j];
+               E.kwtab[slot].len = len;
+               E.kwtab[slot].kind = kinds[k];
+            } else if (E.kwtab[slot].len != len || memcmp(E.kwtab[slot].word, lists[k][j], len)) {
+               ok = 0;
+            }
+            if (len > E.kwmax) E.kwmax = len;
+         }
+      }
+      if (ok) break;
+      free(E.kwtab);
+      seed++;
+      if (seed % 64 == 0) size *= 2;
+   }
+   E.kwmask = size - 1;
+   E.kwseed = seed;
+}
+
+/* HL_KEYWORD, HL_DATATYPE or HL_NORMAL for the token s[0 .. len) */
+
+int keyword_kind(char *s, int len) {
+   hl_keyword *kw;
+
+   if (len == 0 || len > E.kwmax) return HL_NORMAL;
+   kw = &E.kwtab[keyword_hash(s, len, E.kwseed) & E.kwmask];
+   if (kw->word && kw->len == len && !memcmp(kw->word, s, len)) return kw->kind;
+   return HL_NORMAL;
+}
+
+/* highlighting is done lazily : only rows that get drawn (and a few
+ * past the bottom of the screen) are ever lexed. all that the rows
+ * above them contribute is whether a multi-line comment is still open
+ * at their end, so E.hl_valid marks how far down that state is known
+ * and editor_hl_catch_up extends it with a scanner that looks at
+ * nothing but comment and string delimiters. a row whose incoming
+ * state changed after it was lexed is flagged hl_dirty and lexed
+ * again the next time it is drawn.
+ *
+ * the states stored for lines in (hl_valid, hl_chain) each follow from
+ * the one stored above them; only the line at hl_valid may not. so
+ * once the line at hl_valid is found to end the way it did before,
+ * everything up to hl_chain is known again without being looked at.
+ * an edit that opens a comment only costs what is between it and the
+ * point where the states line up again, and is spread over idle time
+ * past the bottom of the screen. */
+
+void mark_hl_dirty(int at) {
+   ed_row_data *row;
+   if (at < E.numrows && (row = row_peek(at)) != NULL) row->hl_dirty = 1;
+}
+
+/* comment state at the end of a line when in_comment was the state at
+ * its start, following the same rules as editor_highlight_span */
+
+int comment_state_after(char *text, int len, int in_comment) {
+   char *scs;
+   char *mcs;
+   char *mce;
+   char *p;
+   int scs_len;
+   int mcs_len;
+   int mce_len;
+   int in_string;
+   int cls;
+   int i;
+
+   scs = E.syntax->sl_cmt_start;
+   mcs = E.syntax->ml_cmt_start;
+   mce = E.syntax->ml_cmt_end;
+   scs_len = scs ? strlen(scs) : 0;
+   mcs_len = strlen(mcs);
+   mce_len = strlen(mce);
+   in_string = 0;
+
+   i = 0;
+   while (i < len) {
+      if (in_comment) {
+         if ((p = memchr(&text[i], mce[0], len - i)) == NULL) break;
+         i = p - text;
+         if (len - i >= mce_len && !memcmp(&text[i], mce, mce_len)) {
+            i += mce_len;
+            in_comment = 0;
+         } else {
+            i++;
+         }
+      } else if (in_string) {
+         while (i < len && text[i] != in_string && text[i] != '\\') i++;
+         if (i < len && text[i] == '\\') i++;
+         else in_string = 0;
+         i++;
+      } else {
+         cls = E.cclass[(unsigned char) text[i]];
+         if ((cls & CC_SCS) && len - i >= scs_len && !memcmp(&text[i], scs, scs_len)) {
+            break;
+         } else if ((cls & CC_MCS) && len - i >= mcs_len && !memcmp(&text[i], mcs, mcs_len)) {
+            i += mcs_len;
+            in_comment = 1;
+         } else if (cls & CC_QUOTE) {
+            in_string = text[i++];
+         } else {
+            i++;
+            while (i < len && !(E.cclass[(unsigned char) text[i]] & (CC_SCS | CC_MCS | CC_QUOTE))) i++;
+         }
+      }
+   }
+   return in_comment;
+}
+
+/* comment state at the end of line at, valid for at < E.hl_valid */
+
+int line_comment_state(int at) {
+   line_node *n;
+   int off;
+
+   if (at < 0) return 0;
+   n = rows_find(at, &off);
+   if (n->row) return n->row->comment_open;
+   return map_comment(n->first + off);
+}
+
+/* makes the comment state known for every line before upto. a line
+ * of the mapping that starts in the state it started in when the
+ * file was loaded ends as it did then, which the loader threads may
+ * already know ; going a long way waits for them rather than doing
+ * the same on its own. */
+
+void editor_hl_catch_up(int upto) {
+   line_node *n;
+   int off;
+   int i;
+   int state;
+   int len;
+   char *text;
+   int changed;
+   int at;
+
+   if (upto > E.numrows) upto = E.numrows;
+   if (E.hl_valid >= upto) return;
+   if (E.syntax == NULL || E.syntax->ml_cmt_start == NULL || E.syntax->ml_cmt_end == NULL) {
+      E.hl_valid = upto;
+      if (E.hl_chain < upto) E.hl_chain = upto;
+      return;
+   }
+   if (upto - E.hl_valid > HL_IDLE_LINES) load_reap(1);
+
+   state = line_comment_state(E.hl_valid - 1);
+   while (E.hl_valid < upto) {
+      at = E.hl_valid;
+      n = rows_find(at, &off);
+      for (; off < n->nlines && at < upto && E.hl_valid == at; off++, at++) {
+         if (n->row) {
+            state = comment_state_after(row_text(n->row), n->row->size, state);
+            changed = (state != n->row->comment_open);
+            n->row->comment_open = state;
+         } else {
+            i = n->first + off;
+            if (E.mapknown && state == (i > 0 && map_known(i - 1))) {
+               state = map_known(i);
+            } else {
+               text = map_line(i, &len);
+               state = comment_state_after(text, len, state);
+            }
+            changed = (state != map_comment(i));
+            map_set_comment(i, state);
+         }
+         editor_hl_settle(at, changed);
+      }
+      if (E.hl_valid != at) state = line_comment_state(E.hl_valid - 1);
+   }
+}
+
+/* the state stored for line at, whose incoming state is known, has
+ * just been recomputed and may have changed */
+
+void editor_hl_settle(int at, int changed) {
+   if (changed) {
+      mark_hl_dirty(at + 1);
+      if (at + 1 < E.hl_valid) E.hl_chain = E.hl_valid;
+      E.hl_valid = at + 1;
+      if (E.hl_chain < E.hl_valid) E.hl_chain = E.hl_valid;
+   } else if (at == E.hl_valid) {
+      E.hl_valid = (E.hl_chain > at + 1) ? E.hl_chain : at + 1;
+   }
+}
+
+/* a new row starts out claiming the state of the row above it, which
+ * is what the row below it was lexed with, so only the new row itself
+ * breaks the chain */
+
+void editor_hl_inserted(int at) {
+   if (at < E.hl_valid) {
+      E.hl_chain = E.hl_valid + 1;
+      E.hl_valid = at;
+   } else if (E.hl_chain > at) {
+      E.hl_chain = at;
+   }
+}
+
+/* n rows were put in at at. when their incoming state is known they
+ * are lexed for their end states right away, and the lines after them
+ * only need another look if the last of them ends differently from
+ * the line above the block */
+
+void editor_hl_inserted_rows(int at, ed_row_data **rows, int n) {
+   int old;
+   int state;
+   int i;
+
+   old = line_comment_state(at - 1);
+   if (at > E.hl_valid) {
+      for (i = 0; i < n; i++) rows[i]->comment_open = old;
+      if (E.hl_chain > at) E.hl_chain = at;
+      return;
+   }
+   state = old;
+   if (E.syntax && E.syntax->ml_cmt_start && E.syntax->ml_cmt_end) {
+      for (i = 0; i < n; i++) {
+         state = comment_state_after(rows[i]->data, rows[i]->size, state);
+         rows[i]->comment_open = state;
+      }
+   }
+   if (at < E.hl_valid && state == old) {
+      E.hl_valid += n;
+      E.hl_chain += n;
+      return;
+   }
+   if (at < E.hl_valid) E.hl_chain = E.hl_valid + n;
+   else E.hl_chain = (E.hl_chain > at) ? E.hl_chain + n : at + n;
+   E.hl_valid = at + n;
+   if (state != old) mark_hl_dirty(at + n);
+}
+
+/* n rows were taken out at at, and the row that took their place has
+ * a new row above. the lines after it that were chained still are */
+
+void editor_hl_deleted(int at, int n) {
+   if (at + n < E.hl_valid) {
+      E.hl_chain = E.hl_valid - n;
+      E.hl_valid = at;
+   } else if (at <= E.hl_valid) {
+      E.hl_chain = (E.hl_chain > at + n) ? E.hl_chain - n : at;
+      E.hl_valid = at;
+   } else if (E.hl_chain > at) {
+      E.hl_chain = at;
+   }
+   mark_hl_dirty(at);
+}
+
+/* the text of line at changed without being lexed again */
+
+void editor_hl_changed(int at) {
+   if (at < E.hl_valid) {
+      E.hl_chain = E.hl_valid;
+      E.hl_valid = at;
+   } else if (E.hl_chain > at) {
+      E.hl_chain = at;
+   }
+}
+
+/* work done while waiting for input, a slice at a time. returns
+ * whether there is more of it left */
+
+int editor_idle() {
+   int more;
+
+   if (!E.load.running) editor_hl_catch_up(E.hl_valid + HL_IDLE_LINES);
+   more = match_idle();
+   return more || (!E.load.running && E.hl_valid < E.numrows);
+}
+
+/* records the comment state a row was found to end in */
+
+void editor_hl_done(ed_row_data *row, int at, int in_comment) {
+   int changed;
+
+   row->hl_dirty = 0;
+   changed = (row->comment_open != in_comment);
+   row->comment_open = in_comment;
+   editor_hl_settle(at, changed);
+}
+
+/* highlights text[from .. to) of a row whose other columns still
+ * carry valid highlighting. lexing restarts at the last plain
+ * separator that no delimiter lookahead could have reached from
+ * inside the span, or at the mark before that if it is closer, and
+ * stops at the first plain separator past the span that was plain
+ * before too : from there on the state is the same as last time, so
+ * is everything it produces. it also stops once it is past both the
+ * span and what of the row is on screen, leaving the rest for later,
+ * and then returns 1 : the comment state at the end of the row is not
+ * known. all the lexer reads is made one stretch of text beforehand : up to
+ * where it stops, plus as much as a delimiter or keyword could look
+ * ahead from there. */
+
+int editor_highlight_span(ed_row_data *row, int at, int from, int to) {
+   int i;
+   int j;
+   char c;
+   int cls;
+   int prev_sep;
+   int in_string;
+   int in_comment;
+   int numbers;
+   char *ren;
+   char *p;
+   unsigned char *hl;
+   unsigned char *cc;
+   char *scs;
+   char *mcs;
+   char *mce;
+   int n;
+   int scs_len;
+   int mcs_len;
+   int mce_len;
+   int look;
+   int upto;
+   int stop;
+   int lim;
+   int end;
+   int off;
+   int last;
+   int m;
+   int k;
+   unsigned char prev_hl;
+   unsigned char old_hl;
+
+   if (at > E.hl_valid) {
+      if (E.hl_chain > at) E.hl_chain = at;
+      row->hl_dirty = 1;
+      return 0;
+   }
+   if (row->hl_dirty) {
+      row->hl_upto = 0;
+      from = 0;
+      to = 0;
+   }
+   n = row->size;
+   upto = row->hl_upto;
+   if (from > upto) from = upto;
+   stop = row_horizon(row);
+   if (stop < to) stop = to;
+   if (E.syntax == NULL) {
+      off = row_span(row, from, stop);
+      memset(&row->highlighted[from + off], HL_NORMAL, stop - from);
+      if (row->hl_upto < stop) row->hl_upto = stop;
+      if (row->hl_upto == n) editor_hl_done(row, at, 0);
+      else row->hl_dirty = 0;
+      return 0;
+   }
+   cc = E.cclass;
+   numbers = E.syntax->flags & HL_NUMBERS;
+   scs = E.syntax->sl_cmt_start;
+   mcs = E.syntax->ml_cmt_start;
+   mce = E.syntax->ml_cmt_end;
+   scs_len = scs ? strlen(scs) : 0;
+   mcs_len = mcs ? strlen(mcs) : 0;
+   mce_len = mce ? strlen(mce) : 0;
+   look = scs_len;
+   if (mcs_len > look) look = mcs_len;
+   if (mce_len > look) look = mce_len;
+   if (stop + look + E.kwmax + 2 >= n) stop = lim = n;
+   else lim = stop + look + E.kwmax + 2;
+
+   i = from - (look ? look : 1);
+   m = row_mark_before(row, i);
+   last = (m >= 0) ? row->marks[2*m] : 0;
+   off = row_span(row, last ? last - 1 : 0, lim);
+   ren = row->data + off;
+   hl = row->highlighted + off;
+   while (i >= last && !(hl[i] == HL_NORMAL && (cc[(unsigned char) ren[i]] & CC_SEP))) i--;
+   prev_sep = 1;
+   in_string = 0;
+   in_comment = 0;
+   if (i >= last) {
+      i++;
+      k = row_mark_before(row, i - 1) + 1;
+   } else if (m >= 0) {
+      i = last;
+      if (row->marks[2*m + 1] < 0) in_comment = -row->marks[2*m + 1];
+      else if (row->marks[2*m + 1] > 1) in_string = row->marks[2*m + 1];
+      else prev_sep = !row->marks[2*m + 1];
+      k = m + 1;
+   } else {
+      i = 0;
+      in_comment = (mcs_len && mce_len) ? line_comment_state(at - 1) : 0;
+      k = 0;
+   }
+   last = (k > 0) ? row->marks[2*k - 2] : 0;
+
+   while (i < stop) {
+      if (i - last >= LEX_CHUNK) {
+         row_mark_put(row, k++, i, in_comment ? -in_comment : in_string ? in_string : !prev_sep);
+         last = i;
+      }
+      /* comment and string bodies and the rest of words are skipped
+       * in bulk up to the next byte that could end them, or the next
+       * mark */
+      end = (last + LEX_CHUNK < stop) ? last + LEX_CHUNK : stop;
+      if (end <= i) end = stop;
+      if (in_comment) {
+         p = (in_comment == 1) ? memchr(&ren[i], mce[0], end - i) : NULL;
+         j = p ? p - ren : end;
+         memset(&hl[i], HL_COMMENT, j - i);
+         i = j;
+         if (p == NULL) continue;
+         if (lim - i >= mce_len && !strncmp(&ren[i], mce, mce_len)) {
+            memset(&hl[i], HL_COMMENT, mce_len);
+            i += mce_len;
+            in_comment = 0;
+            prev_sep = 1;
+         } else {
+            hl[i++] = HL_COMMENT;
+         }
+         continue;
+      }
+      if (in_string) {
+         j = i;
+         while (j < end && ren[j] != in_string && ren[j] != '\\') j++;
+         if (j < end && j + 1 < lim && ren[j] == '\\') {
+            j += 2;
+         } else if (j < end) {
+            if (ren[j] == in_string) in_string = 0;
+            j++;
+         }
+         memset(&hl[i], HL_STRING, j - i);
+         i = j;
+         prev_sep = 1;
+         continue;
+      }
+
+      c = ren[i];
+      cls = cc[(unsigned char) c];
+      prev_hl = (i > 0) ? hl[i-1] : HL_NORMAL;
+
+      if ((cls & CC_SCS) && lim - i >= scs_len && !strncmp(&ren[i], scs, scs_len)) {
+         in_comment = 2;
+         continue;
+      }
+      if ((cls & CC_MCS) && lim - i >= mcs_len && !strncmp(&ren[i], mcs, mcs_len)) {
+         memset(&hl[i], HL_COMMENT, mcs_len);
+         i += mcs_len;
+         in_comment = 1;
+         continue;
+      }
+      if (cls & CC_QUOTE) {
+         in_string = c;
+         hl[i++] = HL_STRING;
+         continue;
+      }
+
+      if (numbers) {
+         if (((cls & CC_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
+            hl[i++] = HL_NUMBER;
+            prev_sep = 0;
+            continue;
+         }
+      }
+
+      if (prev_sep) {
+         int klen;
+         int kind;
+
+         klen = 0;
+         while (klen <= E.kwmax && i + klen < lim && !(cc[(unsigned char) ren[i + klen]] & CC_SEP)) klen++;
+         kind = keyword_kind(&ren[i], klen);
+         if (kind != HL_NORMAL) {
+            memset(&hl[i], kind, klen);
+            i += klen;
+            prev_sep = 0;
+            continue;
+         }
+      }
+
+      old_hl = hl[i];
+      hl[i] = HL_NORMAL;
+      prev_sep = cls & CC_SEP;
+      i++;
+      if (prev_sep) {
+         if (i > to && i <= upto && old_hl == HL_NORMAL) {
+            row_marks_drop(row, k, i);
+            if (upto == n) editor_hl_done(row, at, row->comment_open);
+            else row->hl_dirty = 0;
+            return 0;
+         }
+      } else {
+         /* the rest of a word is plain text */
+         while (i < end && (cc[(unsigned char) ren[i]] & CC_WORD)) hl[i++] = HL_NORMAL;
+      }
+   }
+   row->nmarks = k;
+   if (i < n) {
+      row->hl_upto = i;
+      row->hl_dirty = 0;
+      return 1;
+   }
+   row->hl_upto = n;
+   editor_hl_done(row, at, in_comment == 1);
+   return 0;
+}
+
+/* lexes a row from the start. a row that was dirty ended in a state
+ * that no longer holds, so if it is not lexed to the end the lines
+ * after it have to wait for editor_hl_catch_up */
+
+void editor_update_hl(ed_row_data *row, int at) {
+   int dirty;
+
+   dirty = row->hl_dirty;
+   row->hl_upto = 0;
+   row->nmarks = 0;
+   if (editor_highlight_span(row, at, 0, 0) && dirty) editor_hl_changed(at);
+}
+
+void rehighlight_row(ed_row_data *row, int at) {
+   (void) at;
+   row->hl_dirty = 1;
+}
+
+void select_highlighting() {
+   unsigned int i;
+   unsigned int j;
+   int is_ext;
+   char *ext;
+   struct editor_syntax *old;
+
+   /* the loader threads lex with the syntax as it is, and what they
+    * found only holds for it */
+   load_reap(1);
+   old = E.syntax;
+   E.syntax = NULL;
+   build_char_classes();
+   if (E.filename == NULL) return;
+
+   ext = strrchr(E.filename, '.');
+   
+   for (i = 0; i < HL_DB_ENTRIES; i++) {
+      struct editor_syntax *edsyn = &HL_DB[i];
+      j = 0;
+      while (edsyn->filematch[j]) {
+         is_ext = (edsyn->filematch[j][0] == '.');
+         if ((is_ext && ext && !strcmp(ext, edsyn->filematch[j])) ||
+            (!is_ext && strstr(E.filename, edsyn->filematch[j]))) {
+            E.syntax = edsyn;
+            if (edsyn != old) {
+               free(E.mapknown);
+               E.mapknown = NULL;
+            }
+            build_keyword_table();
+            build_char_classes();
+
+            rows_each(rehighlight_row);
+            E.hl_valid = 0;
+            E.hl_chain = 0;
+
+            return;
+         }
+         j++;
+      }
+   }
+}
+
+/* file io */
+
+/* maps a regular file read-only and appends all of its lines as a
+ * single run. only the line boundaries are computed here. the file
+ * stays open, for save_editor to copy from. returns -1 if the file
+ * cannot be mapped, in which case nothing has been added. */
+
+/* loading. a mapped file is cut into parts of at least
+ * LOAD_PART_MIN bytes, one for each processor up to LOAD_THREADS, and
+ * its lines are found by a thread for each part : they count the
+ * newlines in their part, which tells each of them the number of
+ * its first line, and then put down where their lines start. rows
+ * are only made as lines are looked at, see row_view, so the file can
+ * be shown right after that. the comment state at the end of every
+ * line is then worked out by the same number of threads in the
+ * background, see load_lex. */
+
+void *load_count(void *arg) {
+   load_part *part;
+   char *p;
+
+   part = arg;
+   part->newlines = 0;
+   for (p = part->from; p < part->to && (p = memchr(p, '\n', part->to - p)) != NULL; p++) part->newlines++;
+   part->cr = (memchr(part->from, '\r', part->to - part->from) != NULL);
+   return NULL;
+}
+
+void *load_index(void *arg) {
+   load_part *part;
+   char *p;
+   int line;
+
+   part = arg;
+   line = part->line;
+   for (p = part->from; p < part->to && (p = memchr(p, '\n', part->to - p)) != NULL; p++) E.linestart[line++] = p + 1 - E.map;
+   return NULL;
+}
+
+/* runs fn over every part, each on a thread of its own but the first,
+ * which is done here along with any part whose thread could not be
+ * made */
+
+void load_each(load_job *job, void *(*fn)(void *)) {
+   int i;
+
+   for (i = 1; i < job->nparts; i++) job->parts[i].started = !pthread_create(&job->parts[i].thread, NULL, fn, &job->parts[i]);
+   fn(&job->parts[0]);
+   for (i = 1; i < job->nparts; i++) {
+      if (job->parts[i].started) pthread_join(job->parts[i].thread, NULL);
+      else fn(&job->parts[i]);
+   }
+}
+
+/* lexes the lines of a part for the comment state each ends in, once
+ * as if the part started outside a comment, into known, and once as
+ * if it started inside one, into alt, until the two agree : from
+ * there on they always do. each part starts at a multiple of 8 lines
+ * so that no two threads write the same byte of known. */
+
+void *load_lex(void *arg) {
+   load_part *part;
+   load_job *job;
+   sigset_t all;
+   char *text;
+   int len;
+   int s0;
+   int s1;
+   int i;
+   int j;
+
+   sigfillset(&all);
+   pthread_sigmask(SIG_BLOCK, &all, NULL);
+   part = arg;
+   job = &E.load;
+   s0 = 0;
+   s1 = 1;
+   for (i = 0; i < part->nlines; i++) {
+      j = part->first + i;
+      text = map_line(j, &len);
+      if (part->nalt == i && s1 != s0) {
+         s1 = comment_state_after(text, len, s1);
+         if (s1) part->alt[i / 8] |= 1 << (i % 8);
+         part->nalt = i + 1;
+      }
+      s0 = comment_state_after(text, len, s0);
+      if (s0) job->known[j / 8] |= 1 << (j % 8);
+   }
+
+   pthread_mutex_lock(&job->lock);
+   job->done++;
+   i = (job->done == job->nparts);
+   pthread_mutex_unlock(&job->lock);
+   if (i) write(E.sigpipe[1], "", 1);
+   return NULL;
+}
+
+/* starts the threads for load_lex when the file has multi-line
+ * comments and more than one part. until load_reap picks up what
+ * they found, editor_hl_catch_up only lexes the lines that are
+ * looked at. */
+
+void load_start(int lines) {
+   load_job *job;
+   load_part *part;
+   int i;
+
+   job = &E.load;
+   if (job->nparts < 2 || E.syntax == NULL || E.syntax->ml_cmt_start == NULL || E.syntax->ml_cmt_end == NULL) return;
+   job->known = calloc(lines / 8 + 1, 1);
+   job->done = 0;
+   for (i = 0; i < job->nparts; i++) job->parts[i].first = ((long) lines * i / job->nparts) & ~7;
+   for (i = 0; i < job->nparts; i++) {
+      part = &job->parts[i];
+      part->nlines = ((i + 1 < job->nparts) ? job->parts[i+1].first : lines) - part->first;
+      part->alt = calloc(part->nlines / 8 + 1, 1);
+      part->nalt = 0;
+   }
+   job->running = 1;
+   for (i = 0; i < job->nparts; i++) {
+      part = &job->parts[i];
+      part->started = !pthread_create(&part->thread, NULL, load_lex, part);
+      if (part->started) continue;
+      pthread_mutex_lock(&job->lock);
+      job->done++;
+      pthread_mutex_unlock(&job->lock);
+   }
+}
+
+/* picks up the comment states once the threads are done, or waits
+ * for them when wait is set, going over the parts in order to take
+ * each from alt where the part before it ends inside a comment.
+ * returns whether the threads were picked up. */
+
+int load_reap(int wait) {
+   load_job *job;
+   load_part *part;
+   int state;
+   int lost;
+   int done;
+   int i;
+   int j;
+
+   job = &E.load;
+   if (!job->running) return 0;
+   if (!wait) {
+      pthread_mutex_lock(&job->lock);
+      done = (job->done == job->nparts);
+      pthread_mutex_unlock(&job->lock);
+      if (!done) return 0;
+   }
+   state = 0;
+   lost = 0;
+   for (i = 0; i < job->nparts; i++) {
+      part = &job->parts[i];
+      if (part->started) pthread_join(part->thread, NULL);
+      else lost = 1;
+      for (j = 0; state && j < part->nalt; j++) {
+         if ((part->alt[j / 8] >> (j % 8)) & 1) job->known[(part->first + j) / 8] |= 1 << ((part->first + j) % 8);
+         else job->known[(part->first + j) / 8] &= ~(1 << ((part->first + j) % 8));
+      }
+      j = part->first + part->nlines - 1;
+      if (part->nlines > 0) state = (job->known[j / 8] >> (j % 8)) & 1;
+      free(part->alt);
+   }
+   job->running = 0;
+   if (lost) free(job->known);
+   else E.mapknown = job->known;
+   job->known = NULL;
+   return 1;
+}
+
+int open_mapped(int fd) {
+   struct stat st;
+   load_job *job;
+   char *map;
+   long procs;
+   int lines;
+   int i;
+
+   if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) return -1;
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (map == MAP_FAILED) return -1;
+
+   job = &E.load;
+   procs = sysconf(_SC_NPROCESSORS_ONLN);
+   job->nparts = st.st_size / LOAD_PART_MIN;
+   if (job->nparts > procs) job->nparts = procs;
+   if (job->nparts > LOAD_THREADS) job->nparts = LOAD_THREADS;
+   if (job->nparts < 1) job->nparts = 1;
+   for (i = 0; i < job->nparts; i++) {
+      job->parts[i].from = map + (size_t) st.st_size / job->nparts * i;
+      job->parts[i].to = map + ((i + 1 < job->nparts) ? (size_t) st.st_size / job->nparts * (i + 1) : (size_t) st.st_size);
+   }
+   load_each(job, load_count);
+
+   lines = 1;
+   E.mapcr = 0;
+   for (i = 0; i < job->nparts; i++) {
+      job->parts[i].line = lines;
+      lines += job->parts[i].newlines;
+      E.mapcr |= job->parts[i].cr;
+   }
+   if (map[st.st_size - 1] == '\n') lines--;
+
+   /* one extra entry so that line i always spans up to the newline
+    * just before linestart[i+1], even without a final newline. a
+    * final newline puts down a line start at the end of the file,
+    * which lands in that entry */
+   E.map = map;
+   E.linestart = malloc(sizeof(size_t) * (lines + 1));
+   E.linestart[0] = 0;
+   load_each(job, load_index);
+   E.linestart[lines] = (map[st.st_size - 1] == '\n') ? st.st_size : st.st_size + 1;
+
+   E.maplen = st.st_size;
+   E.mapfd = fd;
+   E.mapcomment = calloc(lines / 8 + 1, 1);
+   rows_insert_run(E.numrows, 0, lines);
+   load_start(lines);
+   return 0;
+}
+
+/* streams. a file that cannot be mapped because it is a pipe, a
+ * fifo or the like is read a piece at a time as it comes in, from
+ * editor_wait, while it is looked at and edited. its text goes into
+ * memory that stands in for the mapping : it is set aside up front,
+ * so it never moves, and only takes up room as it is written. every
+ * line it completes is added at the end of the file as part of a run
+ * of mapping lines, as if the file had been that long all along, so
+ * it costs no more than its text until it is looked at. '-' reads the
+ * text piped in on stdin. */
+
+/* text piped in on stdin is read from another descriptor, and stdin
+ * is made the terminal again for the keys. returns that descriptor. */
+
+int take_stdin() {
+   int fd;
+   int tty;
+
+   fd = dup(STDIN_FILENO);
+   tty = open("/dev/tty", O_RDWR);
+   if (fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1) die("/dev/tty");
+   close(tty);
+   return fd;
+}
+
+void open_stream(int fd) {
+   stream_job *st;
+   size_t size;
+   char *map;
+
+   st = &E.stream;
+   size = (size_t) 1 << 30;
+   if (sizeof(size_t) > 4) size <<= 6;
+   while ((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED) {
+      if (size <= STREAM_CHUNK) die("mmap");
+      size /= 2;
+   }
+
+   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+   st->fd = fd;
+   st->shed = 1;
+   st->len = 0;
+   st->off = 0;
+   st->room = size;
+   st->lines = 0;
+   st->linecap = 1024;
+   E.map = map;
+   E.maplen = 0;
+   E.mapfd = -1;
+   E.mapcr = 0;
+   E.linestart = malloc(sizeof(size_t) * st->linecap);
+   E.linestart[0] = 0;
+   E.mapcomment = calloc(st->linecap / 8, 1);
+   E.mod = 0;
+}
+
+/* makes room in linestart and mapcomment for line lines + 1 */
+
+void stream_line_room(stream_job *st, int lines) {
+   if (lines + 2 <= st->linecap) return;
+   E.linestart = realloc(E.linestart, sizeof(size_t) * st->linecap * 2);
+   E.mapcomment = realloc(E.mapcomment, st->linecap / 4);
+   memset(&E.mapcomment[st->linecap / 8], 0, st->linecap / 8);
+   st->linecap *= 2;
+}
+
+/* adds the lines that have come in since the last time, and once the
+ * stream is done, the one it ended part way through. a save that is
+ * being written reads linestart and maplen, so this waits until it is
+ * done. */
+
+void stream_lines() {
+   stream_job *st;
+   char *p;
+   char *end;
+   char *nl;
+   int lines;
+   int tail;
+   int at;
+
+   st = &E.stream;
+   if (!st->shed || E.save.running || st->len == E.maplen) return;
+   end = E.map + st->len;
+   lines = st->lines;
+   for (p = E.map + E.maplen; (nl = search_next_byte(p, end, '\n')) != NULL; p = nl + 1) {
+      stream_line_room(st, lines);
+      E.linestart[++lines] = nl + 1 - E.map;
+   }
+   if (memchr(E.map + E.maplen, '\r', p - E.map - E.maplen)) E.mapcr = 1;
+   E.maplen = p - E.map;
+
+   /* as with a file that does not end in a newline, the entry after
+    * the last line is one past the end */
+   if (st->fd == -1 && p < end) {
+      if (memchr(p, '\r', end - p)) E.mapcr = 1;
+      stream_line_room(st, lines);
+      E.linestart[++lines] = st->len + 1;
+      E.maplen = st->len;
+   }
+   if (lines == st->lines) return;
+
+   /* a cursor on the last line of a file being followed stays there,
+    * so the screen keeps up with what is written to it */
+   tail = st->notify != -1 && E.cy >= E.numrows - 1;
+   at = E.numrows;
+   rows_insert_run(at, st->lines, lines - st->lines);
+   editor_hl_inserted(at);
+   match_edit(at, 0, lines - st->lines);
+   st->lines = lines;
+   if (tail) {
+      E.cy = (E.cy >= at) ? E.numrows : E.numrows - 1;
+      E.cx = 0;
+   }
+}
+
+/* takes in up to STREAM_CHUNK bytes of what has come in */
+
+void stream_read() {
+   stream_job *st;
+   ssize_t got;
+   size_t n;
+
+   st = &E.stream;
+   n = (st->room - st->len < STREAM_CHUNK) ? st->room - st->len : STREAM_CHUNK;
+   got = (n > 0) ? read(st->fd, E.map + st->len, n) : 0;
+   if (got == -1 && (errno == EAGAIN || errno == EINTR)) return;
+   if (got > 0) {
+      st->len += got;
+      st->off += got;
+   } else if (got == 0 && n > 0 && st->notify != -1) {
+      st->waiting = 1;
+   } else {
+      close(st->fd);
+      st->fd = -1;
+      if (got == -1) set_status_extra("cannot read ! %s", strerror(errno));
+      else if (n == 0) set_status_extra("stopped reading after %lu bytes", (unsigned long) st->len);
+      else set_status_extra("%lu bytes read.", (unsigned long) st->len);
+   }
+   stream_lines();
+}
+
+/* rows made for lines of a stream only keep their text once they
+ * are off screen, and the ones that were never edited go back to
+ * being lines of the mapping */
+
+void stream_shed() {
+   ed_row_data *row;
+   size_t pos;
+   int at;
+   int lo;
+   int hi;
+   int mid;
+
+   for (at = E.stream.top; at < E.stream.top + E.stream.shown && at < E.numrows; at++) {
+      if (at >= E.rowoff && at < E.rowoff + E.rows) continue;
+      if ((row = row_peek(at)) == NULL) continue;
+      row_shed(row);
+      if (!row->view) continue;
+      pos = row->data - E.map;
+      lo = 0;
+      hi = E.stream.lines - 1;
+      while (lo < hi) {
+         mid = lo + (hi - lo) / 2;
+         if (E.linestart[mid] < pos) lo = mid + 1;
+         else hi = mid;
+      }
+      map_set_comment(lo, row->comment_open);
+      rows_unview(at, lo);
+   }
+   E.stream.top = E.rowoff;
+   E.stream.shown = E.rows;
+}
+
+/* following. a file opened with -f is read as a stream that does not
+ * end : once all of it is in, only what is written to it after that
+ * is read, and added as lines as each of them is finished. a file that
+ * gets shorter has been truncated, and one that is no longer the file
+ * at its path has been rotated ; either way the path is opened again
+ * and read from the start, after the lines already in. nothing in a
+ * file being followed can be changed. */
+
+void follow_unwatch() {
+#ifdef __linux__
+   inotify_rm_watch(E.stream.notify, E.stream.watch);
+#endif
+   E.stream.watch = -1;
+}
+
+/* watches the file at the path and opens it, from the start */
+
+int follow_open() {
+   stream_job *st;
+
+   st = &E.stream;
+#ifdef __linux__
+   st->watch = inotify_add_watch(st->notify, E.filename, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#endif
+   if (st->watch == -1) return -1;
+   st->fd = open(E.filename, O_RDONLY | O_NONBLOCK);
+   if (st->fd == -1) {
+      follow_unwatch();
+      return -1;
+   }
+   st->off = 0;
+   st->waiting = 0;
+   return 0;
+}
+
+void follow_retry() {
+   if (follow_open() == -1) {
+      timer_set(&E.stream.retry, FOLLOW_RETRY, follow_retry);
+      return;
+   }
+   set_status_extra("%.40s is back, following it", E.filename);
+   refresh_screen();
+}
+
+/* takes in what is left of the file that was being followed, ends its
+ * last line if it was part way through one, and goes on to the one
+ * now at the path, or tries again every FOLLOW_RETRY ms until there
+ * is one */
+
+void follow_reopen() {
+   stream_job *st;
+   ssize_t got;
+   size_t n;
+
+   st = &E.stream;
+   while ((n = st->room - st->len) > 0) {
+      if (n > STREAM_CHUNK) n = STREAM_CHUNK;
+      if ((got = read(st->fd, E.map + st->len, n)) <= 0) break;
+      st->len += got;
+   }
+   if (st->len > E.maplen && E.map[st->len - 1] != '\n' && st->len < st->room) E.map[st->len++] = '\n';
+   close(st->fd);
+   st->fd = -1;
+   follow_unwatch();
+   stream_lines();
+   if (follow_open() == -1) timer_set(&st->retry, FOLLOW_RETRY, follow_retry);
+}
+
+/* the file being followed was written to, or moved or deleted */
+
+void follow_event() {
+   stream_job *st;
+   struct stat now;
+   struct stat at;
+   char drain[1024];
+
+   st = &E.stream;
+   while (read(st->notify, drain, sizeof(drain)) > 0);
+   if (st->fd == -1 || fstat(st->fd, &now) == -1) return;
+   if (stat(E.filename, &at) == -1 || at.st_ino != now.st_ino || at.st_dev != now.st_dev) {
+      set_status_extra("%.40s was rotated", E.filename);
+      follow_reopen();
+   } else if (now.st_size < st->off) {
+      set_status_extra("%.40s was truncated", E.filename);
+      follow_reopen();
+   } else {
+      st->waiting = 0;
+      stream_read();
+   }
+}
+
+void open_follow(char *filename) {
+   stream_job *st;
 
-   if (buf[0] != '\x1b' || buf[1] != '[') return -1;
-   if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) return -1;
+   st = &E.stream;
+   free(E.filename);
+   E.filename = strdup(filename);
+   select_highlighting();
+#ifdef __linux__
+   st->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+   if (st->notify == -1) die("inotify");
+   if (follow_open() == -1) die("open");
+   open_stream(st->fd);
+}
+
+void open_editor(char *filename) {
+   FILE *file_handle;
+   char *line; 
+   size_t linecap;
+   ssize_t linelen;
+   struct stat st;
+   int fd;
+
+   /* a fifo would otherwise only open once something opens it to
+    * write */
+   fd = open(filename, O_RDONLY | O_NONBLOCK);
+   if (fd == -1) die("open");
+
+   free(E.filename);
+   E.filename = strdup(filename);
+   select_highlighting();
+
+   if (open_mapped(fd) == 0) {
+      E.mod = 0;
+      return;
+   }
+   if (fstat(fd, &st) == 0 && !S_ISREG(st.st_mode)) {
+      open_stream(fd);
+      return;
+   }
+
+   file_handle = fdopen(fd, "r");
+   if (!file_handle) die("fdopen");
+   line = NULL;
+   linecap = 0;
+
+   while ((linelen = getline(&line, &linecap, file_handle)) != -1) {
+      while (linelen > 0 && 
+            (line[linelen-1] == '\n' || 
+             line[linelen-1] == '\r'))
+         linelen--;
+      editor_insert_row(E.numrows, line, linelen);
+   }
+
+   free(line);
+   fclose(file_handle);
+   E.mod = 0;
+}
+
+/* writes out the pieces gathered so far */
+
+int save_flush(save_batch *b) {
+   struct iovec *iov;
+   ssize_t n;
+   int left;
+
+   iov = b->iov;
+   left = b->n;
+   while (left > 0) {
+      n = writev(b->fd, iov, left);
+      if (n == -1) {
+         if (errno == EINTR) continue;
+         return -1;
+      }
+      while (left > 0 && (size_t) n >= iov->iov_len) {
+         n -= iov->iov_len;
+         iov++;
+         left--;
+      }
+      if (left > 0) {
+         iov->iov_base = (char*) iov->iov_base + n;
+         iov->iov_len -= n;
+      }
+   }
+   b->n = 0;
+   return 0;
+}
+
+int save_put(save_batch *b, char *p, size_t len) {
+   if (len == 0) return 0;
+   if (b->n == SAVE_IOV && save_flush(b) == -1) return -1;
+   b->iov[b->n].iov_base = p;
+   b->iov[b->n].iov_len = len;
+   b->n++;
+   b->total += len;
+   return 0;
+}
+
+/* copies len bytes at from in the mapped file to the output without
+ * them passing through the editor, where the system and the file
+ * systems allow it. returns how many bytes were copied */
+
+size_t save_copy(save_batch *b, size_t from, size_t len) {
+   size_t done;
+#ifdef SYS_copy_file_range
+   off_t off;
+   long n;
+
+   done = 0;
+   if (sizeof(off_t) != 8 || save_flush(b) == -1) return 0;
+   off = from;
+   while (done < len) {
+      n = syscall(SYS_copy_file_range, E.mapfd, &off, b->fd, NULL, len - done, 0);
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) break;
+      done += n;
+   }
+   b->total += done;
+#else
+   (void) b;
+   (void) from;
+   (void) len;
+   done = 0;
+#endif
+   return done;
+}
+
+/* a run of nlines lines of the mapping from first on. when the file
+ * has no \r line endings to drop, its bytes are already what is to be
+ * written, and long runs are copied whole */
+
+int save_run(save_batch *b, int first, int nlines) {
+   size_t start;
+   size_t end;
+   size_t done;
+   char *text;
+   int len;
+   int i;
+
+   if (E.mapcr) {
+      for (i = first; i < first + nlines; i++) {
+         text = map_line(i, &len);
+         if (save_put(b, text, len) == -1 || save_put(b, "\n", 1) == -1) return -1;
+      }
+      return 0;
+   }
+   start = E.linestart[first];
+   end = E.linestart[first + nlines];
+   if (end > E.maplen) end = E.maplen;
+   done = (end - start >= SAVE_COPY_MIN) ? save_copy(b, start, end - start) : 0;
+   if (save_put(b, E.map + start + done, end - start - done) == -1) return -1;
+   if (end < E.linestart[first + nlines]) return save_put(b, "\n", 1);
    return 0;
 }
 
-int term_size(int *rows, int *cols) {
-   struct winsize ws;
-   
-   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-      if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
-      read_key();
-      return cursor_pos(rows, cols);
-   } else {
-      *cols = ws.ws_col;
-      *rows = ws.ws_row;
-      return 0;
+/* adds the lines under n to the snapshot of a save, in order */
+
+void save_snapshot(save_job *job, line_node *n) {
+   save_piece *piece;
+
+   while (n) {
+      save_snapshot(job, n->left);
+      if (job->npieces == job->piececap) {
+         job->piececap = job->piececap ? job->piececap * 2 : 256;
+         job->pieces = realloc(job->pieces, job->piececap * sizeof(save_piece));
+      }
+      piece = &job->pieces[job->npieces++];
+      piece->data = NULL;
+      piece->size = 0;
+      piece->first = n->first;
+      piece->nlines = n->nlines;
+      if (n->row) {
+         row_gap_to(n->row, n->row->size);
+         piece->data = n->row->data;
+         piece->size = n->row->size;
+         n->row->frozen = job->gen;
+      }
+      n = n->right;
+   }
+}
+
+int save_pieces(save_batch *b, save_job *job) {
+   save_piece *piece;
+   int i;
+
+   for (i = 0; i < job->npieces; i++) {
+      piece = &job->pieces[i];
+      if (piece->data == NULL) {
+         if (save_run(b, piece->first, piece->nlines) == -1) return -1;
+      } else if (save_put(b, piece->data, piece->size) == -1 || save_put(b, "\n", 1) == -1) {
+         return -1;
+      }
+   }
+   return 0;
+}
+
+/* makes a rename in the directory of path last through a crash */
+
+void save_sync_dir(char *path) {
+   char *slash;
+   int fd;
+
+   slash = strrchr(path, '/');
+   if (slash == NULL) fd = open(".", O_RDONLY);
+   else if (slash == path) fd = open("/", O_RDONLY);
+   else {
+      *slash = '\0';
+      fd = open(path, O_RDONLY);
+      *slash = '/';
+   }
+   if (fd == -1) return;
+   fsync(fd);
+   close(fd);
+}
+
+/* the body of the save thread. the snapshot is written to a new file
+ * next to the target, which is then renamed over it, so a crash leaves
+ * either the old file or the new one. the text goes straight from the
+ * rows and the mapping, and the mapping stays valid since the file it
+ * maps is never written to. */
+
+void *save_thread(void *arg) {
+   save_batch b;
+   save_job *job;
+   struct stat st;
+   sigset_t all;
+   char *target;
+   char *tmp;
+   int mode;
+   int err;
+   int fd;
+
+   sigfillset(&all);
+   pthread_sigmask(SIG_BLOCK, &all, NULL);
+   job = arg;
+   target = realpath(job->path, NULL);
+   if (target == NULL) target = strdup(job->path);
+   mode = (stat(target, &st) == 0) ? (st.st_mode & 07777) : (0644 & ~job->mode_mask);
+   tmp = malloc(strlen(target) + 8);
+   sprintf(tmp, "%s.XXXXXX", target);
+
+   b.n = 0;
+   b.total = 0;
+   b.fd = fd = mkstemp(tmp);
+   err = 0;
+   if (fd == -1) err = errno;
+   else {
+      if (fchmod(fd, mode) == -1 || save_pieces(&b, job) == -1 || save_flush(&b) == -1 || fsync(fd) == -1) err = errno;
+      if (close(fd) == -1 && !err) err = errno;
+      if (!err && rename(tmp, target) == -1) err = errno;
+      if (err) unlink(tmp);
+      else save_sync_dir(target);
+   }
+   job->err = err;
+   job->total = b.total;
+   free(tmp);
+   free(target);
+
+   pthread_mutex_lock(&job->lock);
+   job->done = 1;
+   pthread_mutex_unlock(&job->lock);
+   write(E.sigpipe[1], "", 1);
+   return NULL;
+}
+
+/* picks up a save once its thread is done, or waits for it when wait
+ * is set. the changes made since it started are still unsaved. */
+
+void save_reap(int wait) {
+   save_job *job;
+   int done;
+   int i;
+
+   job = &E.save;
+   if (!job->running) return;
+   if (!wait) {
+      pthread_mutex_lock(&job->lock);
+      done = job->done;
+      pthread_mutex_unlock(&job->lock);
+      if (!done) return;
+   }
+   pthread_join(job->thread, NULL);
+   job->running = 0;
+   for (i = 0; i < job->norphans; i++) row_free(job->orphans[i].data, job->orphans[i].cap);
+   job->norphans = 0;
+   job->npieces = 0;
+   free(job->path);
+   stream_lines();
+
+   if (job->err) set_status_extra("cannot save ! %s", strerror(job->err));
+   else {
+      E.mod -= job->mod;
+      set_status_extra("%ld bytes written.", job->total);
+   }
+   if (job->again) {
+      job->again = 0;
+      save_editor();
+   }
+   refresh_screen();
+}
+
+/* takes a snapshot of the file and hands it to a thread to write, so
+ * that editing goes on while it is written. the snapshot only records
+ * where the text of each line is ; see save_job for how rows keep it
+ * as it was. a save asked for while one is running starts once that
+ * one is done. */
+
+void save_editor() {
+   save_job *job;
+   mode_t mask;
+   int err;
+
+   job = &E.save;
+   if (job->running) {
+      job->again = 1;
+      set_status_extra("saving ...");
+      return;
+   }
+   if (E.filename == NULL) {
+      E.filename = editor_prompt("Save as : %s [ESC to cancel]", 0, NULL);
+      if (E.filename == NULL) {
+         set_status_extra("Did not save file");
+         return;
+      }
+
+      /* the name is the only thing the syntax is chosen by, so what
+       * was worked out for the rows holds on a save under the same one */
+      select_highlighting();
+   }
+
+   mask = umask(0);
+   umask(mask);
+   job->mode_mask = mask;
+   job->path = strdup(E.filename);
+   job->gen++;
+   job->npieces = 0;
+   save_snapshot(job, E.store);
+   job->mod = E.mod;
+   job->done = 0;
+   err = pthread_create(&job->thread, NULL, save_thread, job);
+   if (err) {
+      set_status_extra("cannot save ! %s", strerror(err));
+      free(job->path);
+      return;
+   }
+   job->running = 1;
+   set_status_extra("saving ...");
+}
+
+/* regular expressions */
+
+/* the first c in [p, end), or NULL */
+
+char *search_next_byte(char *p, char *end, int c) {
+   return (p < end) ? memchr(p, c, end - p) : NULL;
+}
+
+/* patterns are made of bytes, . [set] [^set] \d \w \s ( and their
+ * capital negations ), ^ $ ( | ) * + ? and \ to take any of these as
+ * is. a match never spans a line break and is never empty, and the
+ * one reported is the one that starts first, made as long as it can
+ * be. matching goes through dfas that are only built as far as the
+ * text needs them, so it takes time in proportion to the text no
+ * matter the pattern. */
+
+int re_state_new(re_prog *p) {
+   return p->nstates++;
+}
+
+void re_edge_add(re_prog *p, int from, int to, int kind, int set) {
+   if (p->nedges == p->edgecap) {
+      p->edgecap = p->edgecap ? p->edgecap * 2 : 64;
+      p->edges = realloc(p->edges, p->edgecap * sizeof(re_edge));
+   }
+   p->edges[p->nedges].from = from;
+   p->edges[p->nedges].to = to;
+   p->edges[p->nedges].kind = kind;
+   p->edges[p->nedges].set = set;
+   p->nedges++;
+}
+
+int re_set_new(re_prog *p) {
+   p->sets = realloc(p->sets, (p->nsets + 1) * sizeof(*p->sets));
+   memset(p->sets[p->nsets], 0, sizeof(*p->sets));
+   return p->nsets++;
+}
+
+void re_set_add(re_prog *p, int set, int c) {
+   p->sets[set][c >> 3] |= 1 << (c & 7);
+   if (p->icase && isalpha(c)) {
+      p->sets[set][tolower(c) >> 3] |= 1 << (tolower(c) & 7);
+      p->sets[set][toupper(c) >> 3] |= 1 << (toupper(c) & 7);
+   }
+}
+
+/* adds the bytes of \d, \w or \s, or all the others for \D, \W, \S */
+
+int re_set_class(re_prog *p, int set, int c) {
+   int i;
+   int in;
+
+   if (strchr("dwsDWS", c) == NULL) return 0;
+   for (i = 0; i < 256; i++) {
+      switch (tolower(c)) {
+         case 'd': in = isdigit(i); break;
+         case 'w': in = isalnum(i) || i == '_'; break;
+         default: in = (i == ' ' || i == '\t' || i == '\f' || i == '\v');
+      }
+      if (!in == !islower(c)) re_set_add(p, set, i);
+   }
+   return 1;
+}
+
+/* the start and end states of an atom, for anything else the rest of
+ * the pattern after it begins with */
+
+void re_alt(re_prog *p, char **s, int *start, int *end);
+
+void re_atom(re_prog *p, char **s, int *start, int *end) {
+   int set;
+   int neg;
+   int c;
+   int i;
+
+   c = (unsigned char) *(*s)++;
+   if (c == '(') {
+      re_alt(p, s, start, end);
+      if (**s != ')') p->err = 1;
+      else (*s)++;
+      return;
+   }
+   *start = re_state_new(p);
+   *end = re_state_new(p);
+   switch (c) {
+      case '^':
+         re_edge_add(p, *start, *end, RE_BOL, 0);
+         return;
+      case '$':
+         re_edge_add(p, *start, *end, RE_EOL, 0);
+         return;
+   }
+
+   set = re_set_new(p);
+   re_edge_add(p, *start, *end, RE_SET, set);
+   if (c == '.') {
+      memset(p->sets[set], 0xff, sizeof(*p->sets));
+   } else if (c == '\\') {
+      if (**s == '\0') {
+         p->err = 1;
+         return;
+      }
+      c = (unsigned char) *(*s)++;
+      if (!re_set_class(p, set, c)) re_set_add(p, set, (c == 't') ? '\t' : c);
+   } else if (c == '[') {
+      neg = (**s == '^');
+      if (neg) (*s)++;
+      do {
+         if (**s == '\0' || (**s == '\\' && (*s)[1] == '\0')) {
+            p->err = 1;
+            return;
+         }
+         c = (unsigned char) *(*s)++;
+         if (c == '\\') {
+            c = (unsigned char) *(*s)++;
+            if (re_set_class(p, set, c)) continue;
+            if (c == 't') c = '\t';
+         }
+         if ((*s)[0] == '-' && (*s)[1] != ']' && (*s)[1] != '\0') {
+            for (i = c; i <= (unsigned char) (*s)[1]; i++) re_set_add(p, set, i);
+            *s += 2;
+         } else re_set_add(p, set, c);
+      } while (**s != ']');
+      (*s)++;
+      if (neg) {
+         for (i = 0; i < 32; i++) p->sets[set][i] = ~p->sets[set][i];
+      }
+   } else {
+      re_set_add(p, set, c);
+   }
+   p->sets[set]['\n' >> 3] &= ~(1 << ('\n' & 7));
+   p->sets[set]['\r' >> 3] &= ~(1 << ('\r' & 7));
+}
+
+void re_repeat(re_prog *p, char **s, int *start, int *end) {
+   int a;
+   int b;
+
+   re_atom(p, s, start, end);
+   while ((**s == '*' || **s == '+' || **s == '?') && !p->err) {
+      a = re_state_new(p);
+      b = re_state_new(p);
+      re_edge_add(p, a, *start, RE_EPS, 0);
+      re_edge_add(p, *end, b, RE_EPS, 0);
+      if (**s != '+') re_edge_add(p, a, b, RE_EPS, 0);
+      if (**s != '?') re_edge_add(p, *end, *start, RE_EPS, 0);
+      *start = a;
+      *end = b;
+      (*s)++;
+   }
+}
+
+void re_concat(re_prog *p, char **s, int *start, int *end) {
+   int a;
+   int b;
+
+   *start = re_state_new(p);
+   *end = *start;
+   while (**s && **s != '|' && **s != ')' && !p->err) {
+      re_repeat(p, s, &a, &b);
+      re_edge_add(p, *end, a, RE_EPS, 0);
+      *end = b;
+   }
+}
+
+void re_alt(re_prog *p, char **s, int *start, int *end) {
+   int a;
+   int join;
+
+   re_concat(p, s, start, end);
+   if (**s != '|') return;
+   a = re_state_new(p);
+   join = re_state_new(p);
+   re_edge_add(p, a, *start, RE_EPS, 0);
+   re_edge_add(p, *end, join, RE_EPS, 0);
+   while (**s == '|' && !p->err) {
+      (*s)++;
+      re_concat(p, s, start, end);
+      re_edge_add(p, a, *start, RE_EPS, 0);
+      re_edge_add(p, *end, join, RE_EPS, 0);
+   }
+   *start = a;
+   *end = join;
+}
+
+/* lays out the edges of p seen from its start, or turned around and
+ * seen from its final state */
+
+void re_nfa_build(re_nfa *n, re_prog *p, int start, int final, int backward) {
+   re_edge e;
+   int *fill;
+   int i;
+
+   n->nstates = p->nstates;
+   n->start = backward ? final : start;
+   n->final = backward ? start : final;
+   n->sets = p->sets;
+   n->edges = malloc((p->nedges + 1) * sizeof(re_edge));
+   n->first = calloc(p->nstates + 1, sizeof(int));
+   n->mark = calloc(p->nstates, sizeof(int));
+   n->seen = calloc(p->nstates, sizeof(int));
+   n->gen = 0;
+   fill = calloc(p->nstates + 1, sizeof(int));
+   for (i = 0; i < p->nedges; i++) n->first[(backward ? p->edges[i].to : p->edges[i].from) + 1]++;
+   for (i = 0; i < p->nstates; i++) n->first[i + 1] += n->first[i];
+   for (i = 0; i < p->nedges; i++) {
+      e = p->edges[i];
+      if (backward) {
+         e.from = p->edges[i].to;
+         e.to = p->edges[i].from;
+         if (e.kind == RE_BOL) e.kind = RE_EOL;
+         else if (e.kind == RE_EOL) e.kind = RE_BOL;
+      }
+      n->edges[n->first[e.from] + fill[e.from]++] = e;
+   }
+   free(fill);
+}
+
+void re_nfa_free(re_nfa *n) {
+   free(n->edges);
+   free(n->first);
+   free(n->mark);
+   free(n->seen);
+}
+
+void re_dfa_flush(re_dfa *d) {
+   int i;
+
+   for (i = 0; i < d->nst; i++) free(d->st[i].set);
+   d->nst = 0;
+   d->flushes++;
+   d->init[0] = -1;
+   d->init[1] = -1;
+   d->accel_for = -1;
+   for (i = 0; i < RE_HASH; i++) d->hash[i] = -1;
+}
+
+void re_dfa_init(re_dfa *d, re_nfa *n, int unanchored) {
+   d->nfa = n;
+   d->unanchored = unanchored;
+   d->st = malloc(RE_STATES * sizeof(re_dstate));
+   d->list = malloc(n->nstates * sizeof(int));
+   d->nst = 0;
+   d->flushes = 0;
+   re_dfa_flush(d);
+}
+
+void re_dfa_free(re_dfa *d) {
+   re_dfa_flush(d);
+   free(d->st);
+   free(d->list);
+}
+
+/* a compiled pattern, or NULL if it is not a complete one */
+
+re_prog *re_compile(char *pat, int icase) {
+   re_prog *p;
+   int start;
+   int end;
+
+   p = calloc(1, sizeof(re_prog));
+   p->icase = icase;
+   re_alt(p, &pat, &start, &end);
+   if (p->err || *pat != '\0') {
+      free(p->edges);
+      free(p->sets);
+      free(p);
+      return NULL;
+   }
+   re_nfa_build(&p->fwd, p, start, end, 0);
+   re_nfa_build(&p->rev, p, start, end, 1);
+   re_dfa_init(&p->scan, &p->fwd, 1);
+   re_dfa_init(&p->longest, &p->fwd, 0);
+   re_dfa_init(&p->back, &p->rev, 1);
+   return p;
+}
+
+void re_free(re_prog *p) {
+   if (p == NULL) return;
+   re_dfa_free(&p->scan);
+   re_dfa_free(&p->longest);
+   re_dfa_free(&p->back);
+   re_nfa_free(&p->fwd);
+   re_nfa_free(&p->rev);
+   free(p->edges);
+   free(p->sets);
+   free(p);
+}
+
+/* adds s and every state it leads to without taking a byte to the
+ * list, minus those already in it */
+
+void re_closure(re_nfa *n, int s, int bol, int *list, int *len) {
+   re_edge *e;
+   int i;
+   int j;
+
+   if (n->mark[s] == n->gen) return;
+   i = *len;
+   n->mark[s] = n->gen;
+   list[(*len)++] = s;
+   for (; i < *len; i++) {
+      for (j = n->first[list[i]]; j < n->first[list[i] + 1]; j++) {
+         e = &n->edges[j];
+         if (n->mark[e->to] == n->gen) continue;
+         if (e->kind == RE_EPS || (e->kind == RE_BOL && bol)) {
+            n->mark[e->to] = n->gen;
+            list[(*len)++] = e->to;
+         }
+      }
+   }
+}
+
+/* whether the final state can be reached from the list if the line
+ * ends right there */
+
+int re_eol_final(re_nfa *n, int *list, int len) {
+   int *stack;
+   re_edge *e;
+   int found;
+   int top;
+   int s;
+   int j;
+
+   stack = malloc(n->nstates * sizeof(int));
+   top = 0;
+   found = 0;
+   n->gen++;
+   for (j = 0; j < len; j++) {
+      n->seen[list[j]] = n->gen;
+      stack[top++] = list[j];
+   }
+   while (top > 0 && !found) {
+      s = stack[--top];
+      found = (s == n->final);
+      for (j = n->first[s]; j < n->first[s + 1]; j++) {
+         e = &n->edges[j];
+         if ((e->kind == RE_EPS || e->kind == RE_EOL) && n->seen[e->to] != n->gen) {
+            n->seen[e->to] = n->gen;
+            stack[top++] = e->to;
+         }
+      }
+   }
+   free(stack);
+   return found;
+}
+
+int re_cmp(const void *a, const void *b) {
+   return *(const int*) a - *(const int*) b;
+}
+
+/* the dfa state for a sorted list of nfa states. once RE_STATES of
+ * them are made, they are all dropped and built again as needed */
+
+int re_state(re_dfa *d, int *list, int len, int flags) {
+   re_dstate *st;
+   unsigned int h;
+   int i;
+
+   h = flags;
+   for (i = 0; i < len; i++) h = h * 31 + list[i];
+   h &= RE_HASH - 1;
+   while (d->hash[h] != -1) {
+      st = &d->st[d->hash[h]];
+      if (st->n == len && st->flags == flags && !memcmp(st->set, list, len * sizeof(int))) return d->hash[h];
+      h = (h + 1) & (RE_HASH - 1);
+   }
+   if (d->nst == RE_STATES) {
+      re_dfa_flush(d);
+      return re_state(d, list, len, flags);
+   }
+   st = &d->st[d->nst];
+   st->set = malloc((len + 1) * sizeof(int));
+   memcpy(st->set, list, len * sizeof(int));
+   st->n = len;
+   st->flags = flags;
+   memset(st->next, 0xff, sizeof(st->next));
+   d->hash[h] = d->nst;
+   return d->nst++;
+}
+
+int re_start(re_dfa *d, int bol) {
+   re_nfa *n;
+   int len;
+
+   if (d->init[bol] != -1) return d->init[bol];
+   n = d->nfa;
+   n->gen++;
+   len = 0;
+   re_closure(n, n->start, bol, d->list, &len);
+   qsort(d->list, len, sizeof(int), re_cmp);
+   len = re_state(d, d->list, len, 0);
+   d->init[bol] = len;
+   return len;
+}
+
+/* the state byte c leads to from state s, as it goes in next. a
+ * match can only end in it if it took c, so the threads an unanchored dfa starts afresh at
+ * every byte are added after the flags are taken */
+
+int re_next(re_dfa *d, int s, int c) {
+   re_nfa *n;
+   re_edge *e;
+   int flushes;
+   int flags;
+   int len;
+   int bol;
+   int i;
+   int j;
+   int t;
+
+   n = d->nfa;
+   bol = RE_BREAK(c);
+   n->gen++;
+   len = 0;
+   for (i = 0; i < d->st[s].n; i++) {
+      for (j = n->first[d->st[s].set[i]]; j < n->first[d->st[s].set[i] + 1]; j++) {
+         e = &n->edges[j];
+         if (e->kind == RE_SET && (n->sets[e->set][c >> 3] & (1 << (c & 7)))) {
+            re_closure(n, e->to, bol, d->list, &len);
+         }
+      }
+   }
+   flags = 0;
+   if (len && n->mark[n->final] == n->gen) flags |= RE_FINAL;
+   if (len && re_eol_final(n, d->list, len)) flags |= RE_EOL_FINAL;
+   if (d->unanchored) {
+      n->gen++;
+      for (i = 0; i < len; i++) n->mark[d->list[i]] = n->gen;
+      re_closure(n, n->start, bol, d->list, &len);
+   }
+   qsort(d->list, len, sizeof(int), re_cmp);
+   flushes = d->flushes;
+   t = re_state(d, d->list, len, flags);
+   if (flushes == d->flushes) d->st[s].next[c] = (t << 1) | (flags != 0);
+   return (t << 1) | (flags != 0);
+}
+
+/* finds the bytes that lead out of state s, for the scan to skip to
+ * with memchr when there are no more than two of them */
+
+void re_accel(re_dfa *d, int s) {
+   int flushes;
+   int c;
+   int k;
+
+   flushes = d->flushes;
+   d->naccel = 0;
+   for (c = 0; c < 256 && d->naccel <= 2; c++) {
+      k = d->st[s].next[c];
+      if (k < 0) k = re_next(d, s, c);
+      if (flushes != d->flushes) return;
+      if (k != s << 1) {
+         if (d->naccel < 2) d->accel[d->naccel] = c;
+         d->naccel++;
+      }
+   }
+   d->accel_for = s;
+}
+
+/* whether a match ends before p, in a state with flags, where the
+ * text goes on to end. for the backward dfa the text is walked the
+ * other way, so it is what comes before p that counts */
+
+int re_ends(int flags, char *p, char *end, int backward) {
+   if (flags & RE_FINAL) return 1;
+   if (!(flags & RE_EOL_FINAL)) return 0;
+   if (backward) return p == end || RE_BREAK(p[-1]);
+   return p == end || RE_BREAK(*p);
+}
+
+/* first match in [from, data + size) of a pattern, where data is the
+ * start of the text from lies in. the forward dfa finds where the
+ * earliest match ends. no match starts past that, so the threads it
+ * has going are followed until they die out, which is as far as the
+ * first match can reach. the text is then walked backward from there
+ * to find where the first match starts, and forward from that to
+ * where it ends. */
+
+char *re_search(re_prog *p, char *data, int size, char *from, int *mlen) {
+   re_dstate *st;
+   char *end;
+   char *t;
+   char *ls;
+   char *reach;
+   char *best;
+   char *last;
+   char *lo;
+   char *up;
+   int s;
+   int k;
+
+   end = data + size;
+   st = p->scan.st;
+   s = re_start(&p->scan, 0);
+   if (p->scan.accel_for != s) re_accel(&p->scan, s);
+   lo = data;
+   up = data;
+   while (from < end) {
+      s = re_start(&p->scan, from == data || RE_BREAK(from[-1]));
+      for (t = from; t < end; t++) {
+         if (s == p->scan.accel_for && p->scan.naccel <= 2) {
+            if (lo < t) lo = (p->scan.naccel > 0) ? search_next_byte(t, end, p->scan.accel[0]) : NULL;
+            if (lo == NULL) lo = end;
+            if (up < t) up = (p->scan.naccel > 1) ? search_next_byte(t, end, p->scan.accel[1]) : NULL;
+            if (up == NULL) up = end;
+            t = (lo < up) ? lo : up;
+            if (t == end) break;
+         }
+         k = st[s].next[(unsigned char) *t];
+         if (k < 0) k = re_next(&p->scan, s, (unsigned char) *t);
+         s = k >> 1;
+         if ((k & 1) && re_ends(st[s].flags, t + 1, end, 0)) break;
+      }
+      if (t++ == end) return NULL;
+
+      for (ls = t - 1; ls > from && !RE_BREAK(ls[-1]); ls--);
+      reach = t;
+      s = re_state(&p->longest, st[s].set, st[s].n, 0);
+      while (t < end && !RE_BREAK(*t) && p->longest.st[s].n) {
+         k = p->longest.st[s].next[(unsigned char) *t];
+         if (k < 0) k = re_next(&p->longest, s, (unsigned char) *t);
+         s = k >> 1;
+         t++;
+         if ((k & 1) && re_ends(p->longest.st[s].flags, t, end, 0)) reach = t;
+      }
+      best = NULL;
+      s = re_start(&p->back, reach == end || RE_BREAK(*reach));
+      for (t = reach; t > ls; ) {
+         t--;
+         k = p->back.st[s].next[(unsigned char) *t];
+         if (k < 0) k = re_next(&p->back, s, (unsigned char) *t);
+         s = k >> 1;
+         if ((k & 1) && re_ends(p->back.st[s].flags, t, data, 1)) best = t;
+      }
+      if (best == NULL) {
+         from = reach;
+         continue;
+      }
+
+      last = best;
+      s = re_start(&p->longest, best == data || RE_BREAK(best[-1]));
+      for (t = best; t < reach && p->longest.st[s].n; ) {
+         k = p->longest.st[s].next[(unsigned char) *t];
+         if (k < 0) k = re_next(&p->longest, s, (unsigned char) *t);
+         s = k >> 1;
+         t++;
+         if ((k & 1) && re_ends(p->longest.st[s].flags, t, end, 0)) last = t;
+      }
+      *mlen = last - best;
+      return best;
+   }
+   return NULL;
+}
+
+/* incremental search */
+
+/* whether the query matches the text at t */
+
+int search_match(search_query *q, char *t) {
+   int i;
+   if (!q->icase) return !memcmp(t, q->pat, q->len);
+   for (i = 0; i < q->len && q->fold[(unsigned char) t[i]] == (unsigned char) q->pat[i]; i++);
+   return i == q->len;
+}
+
+/* first match of a plain query within size bytes at data. memchr
+ * looks for the rarest byte of the query ( in either case when case is
+ * ignored ) and the rest is compared around each hit, last byte
+ * first. */
+
+char *search_literal(search_query *q, char *data, int size) {
+   char *p;
+   char *end;
+   char *lo;
+   char *up;
+   int a;
+   int last;
+
+   if (q->len == 0) return data;
+   if (size < q->len) return NULL;
+
+   a = q->anchor;
+   last = q->len - 1;
+   end = data + size - last + a;
+   lo = search_next_byte(data + a, end, q->pat[a]);
+   up = (q->other != q->pat[a]) ? search_next_byte(data + a, end, q->other) : NULL;
+   while (lo || up) {
+      p = (up == NULL || (lo && lo < up)) ? lo : up;
+      if (q->fold[(unsigned char) p[last - a]] == (unsigned char) q->pat[last] && search_match(q, p - a)) return p - a;
+      if (p == lo) lo = search_next_byte(lo + 1, end, q->pat[a]);
+      else up = search_next_byte(up + 1, end, q->other);
    }
+   return NULL;
 }
 
-/* syntax highlighting */
+/* first match of a query in [from, data + size), where data is the
+ * start of the text from lies in. its length goes to *len */
 
-int is_separator(int c) {
-   return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+char *search_line(search_query *q, char *data, int size, char *from, int *len) {
+   if (q->regex) return q->re ? re_search(q->re, data, size, from, len) : NULL;
+   *len = q->len;
+   return search_literal(q, from, data + size - from);
 }
 
-void editor_update_hl(ed_row_data *row) {
-   int i;
-   char c;
-   int prev_sep;
-   int in_string;
-   int in_comment;
-   int changed;
-   char *scs;
-   char *mcs;
-   char *mce;
-   char **kd;
-   char **dt;
-   int scs_len;
-   int mcs_len;
-   int mce_len;
-   unsigned char prev_hl;
+/* number of matches in size bytes at data, not overlapping */
 
-   row->highlighted = realloc(row->highlighted, row->rensize);
-   memset(row->highlighted, HL_NORMAL, row->rensize); 
+int match_count(search_query *q, char *data, int size) {
+   char *p;
+   int len;
+   int n;
 
-   if (E.syntax == NULL) return;
-   scs = E.syntax->sl_cmt_start;
-   mcs = E.syntax->ml_cmt_start;
-   mce = E.syntax->ml_cmt_end;
-   scs_len = scs ? strlen(scs) : 0;
-   mcs_len = mcs ? strlen(mcs) : 0;
-   mce_len = mce ? strlen(mce) : 0;
-   kd = E.syntax->keyword;
-   dt = E.syntax->datatypes;
-   prev_sep = 1;
-   i = 0;
-   in_string = 0;
-   in_comment = (row->idx > 0 && E.rows_data[row->idx - 1].comment_open);
+   n = 0;
+   for (p = data; (p = search_line(q, data, size, p, &len)) != NULL; p += len) n++;
+   return n;
+}
 
-   while (i < row->rensize) {
-      c = row->render[i];
-      prev_hl = (i > 0) ? row->highlighted[i-1] : HL_NORMAL;
+int match_size() {
+   return E.matches.cap - E.matches.gapend + E.matches.gap;
+}
 
-      if (scs_len && !in_string && !in_comment) {
-         if (!strncmp(&row->render[i], scs, scs_len)) {
-            memset(&row->highlighted[i], HL_COMMENT, row->rensize - i);
-            break;
-         }
-      } 
-
-      if (mcs_len && mce_len && !in_string) {
-         if (in_comment) {
-            row->highlighted[i] = HL_COMMENT;
-            if (!strncmp(&row->render[i], mce, mce_len)) {
-               memset(&row->highlighted[i], HL_COMMENT, mce_len);
-               i += mce_len;
-               in_comment = 0;
-               prev_sep = 1;
-               continue;
-            } else {
-               i++;
-               continue;
-            }
-         } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-            memset(&row->highlighted[i], HL_COMMENT, mcs_len);
-            i += mcs_len;
-            in_comment = 1;
-            continue;
-         }
-      }
+int match_line(int i) {
+   match_index *m = &E.matches;
+   if (i < m->gap) return m->line[i];
+   return m->line[i + m->gapend - m->gap] + m->scanned;
+}
 
-      if (E.syntax->flags & HL_STRING) {
-         if (in_string) {
-            row->highlighted[i] = HL_STRING;
-            if (c == '\\' && i+1 < row->rensize) {
-               row->highlighted[i+1] = HL_STRING;
-               i += 2;
-               continue;
-            }
-            if (c == in_string) in_string = 0;
-            i++;
-            prev_sep = 1;
-            continue;
-         } else {
-            if (c == '"' || c == '\'') {
-               in_string = c;
-               row->highlighted[i] = HL_STRING;
-               i++;
-               continue;
-            }
-         }
-      }
+int match_before(int i) {
+   match_index *m = &E.matches;
+   if (i < m->gap) return m->before[i];
+   return m->before[i + m->gapend - m->gap] + m->total;
+}
 
-      if (E.syntax->flags & HL_NUMBERS) {
-         if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
-            row->highlighted[i] = HL_NUMBER;
-            i++;
-            prev_sep = 0;
-            continue;
-         }
-      }
+/* the first entry for a line at or after line */
 
-      if (prev_sep) {
-         int j;
-         int klen;
-         for (j = 0; kd[j]; j++) {
-            klen = strlen(kd[j]);
+int match_lower(int line) {
+   int lo;
+   int hi;
+   int mid;
 
-            if (!strncmp(&row->render[i], kd[j], klen) && is_separator(row->render[i + klen])) {
-               memset(&row->highlighted[i], HL_KEYWORD, klen);
-               i += klen;
-               break;
-            }
-            if (kd[j] != NULL) {
-               prev_sep = 0;
-               continue;
-            }
-         }
-         for (j = 0; dt[j]; j++) {
-            klen = strlen(dt[j]);
+   lo = 0;
+   hi = match_size();
+   while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (match_line(mid) < line) lo = mid + 1;
+      else hi = mid;
+   }
+   return lo;
+}
 
-            if (!strncmp(&row->render[i], dt[j], klen) && is_separator(row->render[i + klen])) {
-               memset(&row->highlighted[i], HL_DATATYPE, klen);
-               i += klen;
-               break;
-            }
-            if (dt[j] != NULL) {
-               prev_sep = 0;
-               continue;
-            }
-         }
-      }
+void match_gap_to(int i) {
+   match_index *m = &E.matches;
+   while (m->gap > i) {
+      m->gap--;
+      m->gapend--;
+      m->line[m->gapend] = m->line[m->gap] - m->scanned;
+      m->before[m->gapend] = m->before[m->gap] - m->total;
+   }
+   while (m->gap < i) {
+      m->line[m->gap] = m->line[m->gapend] + m->scanned;
+      m->before[m->gap] = m->before[m->gapend] + m->total;
+      m->gap++;
+      m->gapend++;
+   }
+}
 
-      prev_sep = is_separator(c);
-      i++;
+/* puts in an entry at the gap for a line holding count matches */
+
+void match_put(int line, int count) {
+   match_index *m = &E.matches;
+   int grow;
+
+   if (m->gap == m->gapend) {
+      grow = m->cap ? m->cap : 64;
+      m->line = realloc(m->line, (m->cap + grow) * sizeof(int));
+      m->before = realloc(m->before, (m->cap + grow) * sizeof(int));
+      memmove(&m->line[m->gapend + grow], &m->line[m->gapend], (m->cap - m->gapend) * sizeof(int));
+      memmove(&m->before[m->gapend + grow], &m->before[m->gapend], (m->cap - m->gapend) * sizeof(int));
+      m->gapend += grow;
+      m->cap += grow;
    }
-   changed = (row->comment_open != in_comment);
-   row->comment_open = in_comment;
-   if (changed && row->idx + 1 < E.numrows) editor_update_hl(&E.rows_data[row->idx + 1]);
+   m->line[m->gap] = line;
+   m->before[m->gap] = (m->gapend < m->cap) ? m->before[m->gapend] + m->total : m->total;
+   m->gap++;
+   m->total += count;
 }
 
-void select_highlighting() {
-   unsigned int i;
-   unsigned int j;
-   int is_ext;
-   int loopvar;
-   char *ext;
+/* takes out the entry right after the gap */
 
-   E.syntax = NULL;
-   if (E.filename == NULL) return;
+void match_take() {
+   match_index *m = &E.matches;
+   int next;
 
-   ext = strrchr(E.filename, '.');
-   
-   for (i = 0; i < HL_DB_ENTRIES; i++) {
-      struct editor_syntax *edsyn = &HL_DB[i];
-      j = 0;
-      while (edsyn->filematch[j]) {
-         is_ext = (edsyn->filematch[j][0] == '.');
-         if ((is_ext && ext && !strcmp(ext, edsyn->filematch[j])) ||
-            (!is_ext && strstr(E.filename, edsyn->filematch[j]))) {
-            E.syntax = edsyn;
+   next = (m->gapend + 1 < m->cap) ? m->before[m->gapend + 1] : 0;
+   m->total -= next - m->before[m->gapend];
+   m->gapend++;
+}
+
+/* empties the index, knowing that no line before from holds a match */
 
-            for (loopvar = 0; loopvar < E.numrows; loopvar++) editor_update_hl(&E.rows_data[loopvar]);
+void match_reset(int from) {
+   E.matches.gap = 0;
+   E.matches.gapend = E.matches.cap;
+   E.matches.scanned = from;
+   E.matches.total = 0;
+}
+
+/* indexes the lines from scanned on up to upto, or when first is set
+ * up to the first of them holding a match. a run of lines still in
+ * the mapping is searched as one stretch of text, since no match can
+ * reach over a line break. */
+
+void match_extend(int upto, int first) {
+   match_index *m;
+   search_query *q;
+   line_node *n;
+   char *p;
+   char *start;
+   char *end;
+   char *text;
+   int size;
+   int mlen;
+   int off;
+   int base;
+   int line;
+   int last;
+   int len;
 
+   m = &E.matches;
+   q = &E.search;
+   if (!q->valid || q->len == 0) return;
+   if (upto > E.numrows) upto = E.numrows;
+   match_gap_to(match_size());
+   size = match_size();
+   while (m->scanned < upto && !(first && match_size() > size)) {
+      n = rows_find(m->scanned, &off);
+      if (n->row) {
+         len = match_count(q, row_text(n->row), n->row->size);
+         if (len) match_put(m->scanned, len);
+         m->scanned++;
+         continue;
+      }
+      base = m->scanned;
+      last = n->nlines - off;
+      if (last > upto - base) last = upto - base;
+      line = n->first + off;
+      start = E.map + E.linestart[line];
+      end = E.map + E.linestart[line + last];
+      if (end > E.map + E.maplen) end = E.map + E.maplen;
+      p = start;
+      while (p < end && (p = search_line(q, start, end - start, p, &mlen)) != NULL) {
+         while (E.linestart[line + 1] <= (size_t) (p - E.map)) line++;
+         text = map_line(line, &len);
+         match_put(base + line - n->first - off, match_count(q, text, len));
+         if (first) {
+            m->scanned = base + line - n->first - off + 1;
             return;
          }
-         j++;
+         p = E.map + E.linestart[line + 1];
       }
+      m->scanned = base + last;
    }
 }
 
-/* file io */
-
-void open_editor(char *filename) {
-   FILE *file_handle = fopen(filename, "r");
-   char *line; 
-   size_t linecap;
-   ssize_t linelen;
-
-   if (!file_handle) die("fopen");
-   line = NULL;
-   linecap = 0;
+/* lines [at, at + removed) were replaced by lines [at, at + added) */
 
-   free(E.filename);
-   E.filename = strdup(filename);
-   select_highlighting();
+void match_edit(int at, int removed, int added) {
+   match_index *m;
+   search_query *q;
+   char *text;
+   int count;
+   int len;
+   int i;
 
-   while ((linelen = getline(&line, &linecap, file_handle)) != -1) {
-      while (linelen > 0 && 
-            (line[linelen-1] == '\n' || 
-             line[linelen-1] == '\r'))
-         linelen--;
-      editor_insert_row(E.numrows, line, linelen);
+   m = &E.matches;
+   q = &E.search;
+   if (!q->valid || q->len == 0 || at >= m->scanned) return;
+   match_gap_to(match_lower(at));
+   if (at + removed > m->scanned) {
+      while (m->gapend < m->cap) match_take();
+      m->scanned = at;
+      return;
+   }
+   while (m->gapend < m->cap && m->line[m->gapend] + m->scanned < at + removed) match_take();
+   m->scanned += added - removed;
+   for (i = at; i < at + added; i++) {
+      text = line_peek(i, &len);
+      count = match_count(q, text, len);
+      if (count) match_put(i, count);
    }
-
-   free(line);
-   fclose(file_handle);
-   E.mod = 0;
 }
 
-char *editor_to_string(int *len) {
-   int totlen; 
-   int j;
-   char *content;
-   char *pointer;
+/* offset of the first match in text after ( dir 1 ) or the last one
+ * before ( dir -1 ) offset cx, or -1 */
+
+int match_near(char *text, int len, int cx, int dir) {
+   search_query *q;
+   char *p;
+   int found;
+   int mlen;
+
+   q = &E.search;
+   found = -1;
+   for (p = text; (p = search_line(q, text, len, p, &mlen)) != NULL; p += mlen) {
+      if (dir > 0 && p - text > cx) return p - text;
+      if (dir < 0 && p - text >= cx) break;
+      found = p - text;
+   }
+   return (dir > 0) ? -1 : found;
+}
 
-   content = NULL;
-   pointer = NULL;
-   totlen = 0;
-   
-   for (j = 0; j < E.numrows; j++)
-      totlen += E.rows_data[j].size + 1;
-   
-   *len = totlen;
-   content = malloc(totlen);
-   pointer = content;
+/* which of all the matches the cursor is on, or 0 when it is not on
+ * one, or the number is not known yet */
 
-   for (j = 0; j < E.numrows; j++) {
-      memcpy(pointer, E.rows_data[j].data, E.rows_data[j].size);
-      pointer += E.rows_data[j].size;
-      *pointer = '\n';
-      pointer++;
+int match_ordinal() {
+   search_query *q;
+   char *text;
+   char *p;
+   int mlen;
+   int len;
+   int i;
+   int k;
+
+   q = &E.search;
+   if (E.cy >= E.matches.scanned) return 0;
+   i = match_lower(E.cy);
+   if (i == match_size() || match_line(i) != E.cy) return 0;
+   text = line_peek(E.cy, &len);
+   k = match_before(i);
+   for (p = text; (p = search_line(q, text, len, p, &mlen)) != NULL && p - text <= E.cx; p += mlen) {
+      k++;
+      if (p - text == E.cx) return k;
    }
-
-   return content; 
+   return 0;
 }
 
-void save_editor() {
+/* moves the cursor to the next ( dir 1 ) or the previous ( dir -1 )
+ * match, wrapping around the ends of the file */
+
+void match_step(int dir) {
+   char *text;
    int len;
-   char *content;
-   int fd;
+   int i;
+   int cx;
 
-   if (E.filename == NULL) {
-      E.filename = editor_prompt("Save as : %s [ESC to cancel]", NULL);
-      if (E.filename == NULL) {
-         set_status_extra("Did not save file");
+   if (E.cy < E.numrows) {
+      text = line_peek(E.cy, &len);
+      cx = match_near(text, len, E.cx, dir);
+      if (cx != -1) {
+         E.cx = cx;
          return;
       }
    }
-
-   select_highlighting();
-   content = editor_to_string(&len);
-   fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-   
-   if (fd != -1) {
-      if (ftruncate(fd, len) != -1) {
-         if (write(fd, content, len) == len) {
-            close(fd);
-            free(content);
-            E.mod = 0;
-            set_status_extra("%d bytes written.", len);
-            return;
-         }
+   match_extend(E.cy + 1, 0);
+   if (dir > 0) {
+      i = match_lower(E.cy + 1);
+      if (i == match_size()) match_extend(E.numrows, 1);
+      if (i == match_size()) i = 0;
+   } else {
+      i = match_lower(E.cy) - 1;
+      if (i < 0) {
+         match_extend(E.numrows, 0);
+         i = match_size() - 1;
       }
-      close(fd);
    }
-   free(content);
-   set_status_extra("cannot save ! %s", strerror(errno));
+   if (i < 0 || i >= match_size()) return;
+   E.cy = match_line(i);
+   text = line_peek(E.cy, &len);
+   E.cx = match_near(text, len, (dir > 0) ? -1 : len + 1, dir);
 }
 
-/* incremental search */
+/* puts the cursor on the first match, if the prompt is still waiting
+ * for one and it has been found. returns whether it moved */
 
-void callback_find(char* search_for, int key) {
-   static int last = -1;
-   static int direction = 1;
+int match_seek() {
+   search_query *q;
+   char *text;
+   int len;
+
+   q = &E.search;
+   if (!q->seek || match_size() == 0) return 0;
+   q->seek = 0;
+   q->first = match_line(0);
+   text = line_peek(q->first, &len);
+   E.cy = q->first;
+   E.cx = match_near(text, len, -1, 1);
+   E.rowoff = E.numrows;
+   return 1;
+}
+
+/* indexes another slice of lines while idle. the screen is redrawn
+ * when that finds the first match for the prompt, and once the whole
+ * file is done for the final count. returns whether there is more
+ * left */
+
+int match_idle() {
+   if (!E.search.valid || E.search.len == 0 || E.matches.scanned >= E.numrows) return 0;
+   match_extend(E.matches.scanned + MATCH_IDLE_LINES, 0);
+   if (match_seek() || E.matches.scanned >= E.numrows) refresh_screen();
+   return E.matches.scanned < E.numrows;
+}
 
-   static int prev_instance_line;
-   static char *prev_instance = NULL;
+/* picks the byte of the pattern that is least common in the start of
+ * the file for search_line to look for */
 
+void search_pick_anchor(search_query *q) {
+   int count[256];
+   int n;
    int i;
-   int current;
-   ed_row_data *row;
-   char* match;
+   int c;
 
-   if (prev_instance) {
-      memcpy(E.rows_data[prev_instance_line].highlighted, prev_instance, E.rows_data[prev_instance_line].rensize);
-      free(prev_instance);
-      prev_instance = NULL;
+   memset(count, 0, sizeof(count));
+   n = (E.map && E.maplen < SEARCH_SAMPLE) ? (int) E.maplen : (E.map ? SEARCH_SAMPLE : 0);
+   for (i = 0; i < n; i++) count[q->fold[(unsigned char) E.map[i]]]++;
+   q->anchor = 0;
+   for (i = 1; i < q->len; i++) {
+      if (count[(unsigned char) q->pat[i]] <= count[(unsigned char) q->pat[q->anchor]]) q->anchor = i;
    }
+   c = (unsigned char) q->pat[q->anchor];
+   q->other = q->icase ? toupper(c) : c;
+}
 
-   if (key == '\r' || key == '\x1b') {
-      last = -1;
-      direction = 1;
-      return;
-   } else if (key == ARROWR || key == ARROWD) {
-      direction = 1;
-   } else if (key == ARROWL || key == ARROWU) {
-      direction = -1;
+/* sets the query to pat, and q->first to the first line holding a
+ * match of it if that is found within the first slice of lines ; the
+ * rest is searched while idle. a match of the new query contains one
+ * of the old query when the new one is the old one with some letters
+ * typed around it, so then the lines before the old first match, or
+ * all the lines searched so far, cannot hold one and the search picks
+ * up from there. patterns are compiled anew each time. */
+
+void search_update(search_query *q, char *pat, int icase, int regex) {
+   char *folded;
+   int from;
+   int len;
+   int i;
+
+   len = strlen(pat);
+   from = 0;
+   if (q->valid && q->len && !q->regex && !regex && (q->icase || !icase)) {
+      folded = malloc(len + 1);
+      for (i = 0; i <= len; i++) folded[i] = q->fold[(unsigned char) pat[i]];
+      if (strstr(folded, q->pat) != NULL) from = (q->first == -1) ? E.matches.scanned : q->first;
+      free(folded);
+      if (from && icase == q->icase && len == q->len) return;
+   }
+   if (q->valid && q->regex && regex && icase == q->icase && !strcmp(pat, q->pat)) return;
+
+   free(q->pat);
+   re_free(q->re);
+   q->re = NULL;
+   q->pat = malloc(len + 1);
+   q->len = len;
+   q->icase = icase;
+   q->regex = regex;
+   for (i = 0; i < 256; i++) q->fold[i] = icase ? tolower(i) : i;
+   if (regex) {
+      memcpy(q->pat, pat, len + 1);
+      if (len) q->re = re_compile(pat, icase);
    } else {
-      last = -1;
-      direction = 1;
+      for (i = 0; i <= len; i++) q->pat[i] = q->fold[(unsigned char) pat[i]];
+      search_pick_anchor(q);
    }
+   q->valid = 1;
+   match_reset(from);
+   match_extend(from + MATCH_IDLE_LINES, 1);
+   q->first = match_size() ? match_line(0) : -1;
+}
 
-   if (last == -1) direction = 1;
-   current = last; 
-
-   for (i = 0; i < E.numrows; i++) {
-      current += direction;
-      if (current == -1) current = E.numrows - 1;
-      else if (current == E.numrows) current = 0;
-
-      row = &E.rows_data[current];
-      match = strstr(row->render, search_for);
-      if (match) {
-         last = current;
-         E.cy = current;
-         E.cx = rx_to_cx(row, match - row->render);
-         E.rowoff = E.numrows;
+void find_set_prompt() {
+   snprintf(E.find_prompt, sizeof(E.find_prompt), "%s%s%s : %%s [ESC to cancel]",
+      E.find_replace ? "Replace" : "Search",
+      E.find_regex ? " ( regex )" : "",
+      E.find_icase ? " ( any case )" : "");
+}
 
-         prev_instance_line = current;
-         prev_instance = malloc(row->rensize);
-         memcpy(prev_instance, row->highlighted, row->rensize);
-         memset(&row->highlighted[match - row->render], HL_MATCH, strlen(search_for));
+void callback_find(char* search_for, int key) {
+   search_query *q;
 
-         break;
-      }
+   q = &E.search;
+   if (key == '\r' || key == '\x1b') {
+      q->seek = 0;
+      if (key == '\x1b') q->valid = 0;
+      return;
+   } else if (key == ARROWR || key == ARROWD || key == ARROWL || key == ARROWU) {
+      if (!q->valid || q->first == -1) return;
+      match_step((key == ARROWR || key == ARROWD) ? 1 : -1);
+      E.rowoff = E.numrows;
+   } else {
+      if (key == CASE_KEY) E.find_icase = !E.find_icase;
+      if (key == REGEX_KEY) E.find_regex = !E.find_regex;
+      find_set_prompt();
+      search_update(q, search_for, E.find_icase, E.find_regex);
+      q->seek = 1;
+      match_seek();
    }
 }
 
@@ -862,7 +5300,9 @@ void find_editor() {
    old_coloff = E.coloff;
    old_rowoff = E.rowoff;
 
-   search_for = editor_prompt("Search : %s [ESC to cancel]", callback_find);
+   E.search.valid = 0;
+   find_set_prompt();
+   search_for = editor_prompt(E.find_prompt, 0, callback_find);
    
    if (search_for) free(search_for);
    else {
@@ -873,11 +5313,208 @@ void find_editor() {
    }
 }
 
+/* replace */
+
+/* rewrites row, which is line at, with every match of the query in
+ * it replaced by with, as one new text. the highlighting is dropped,
+ * to be made again when the row is drawn. returns the number of matches
+ * replaced */
+
+int replace_in_row(ed_row_data *row, int at, search_query *q, char *with, int wlen) {
+   static struct buffer text = BUFFER_INIT;
+   undo_op *op;
+   char *old;
+   char *last;
+   char *p;
+   int mlen;
+   int n;
+
+   old = row_text(row);
+   last = old;
+   text.len = 0;
+   n = 0;
+   for (p = old; (p = search_line(q, old, row->size, p, &mlen)) != NULL; p += mlen) {
+      buffer_append(&text, last, p - last);
+      buffer_append(&text, with, wlen);
+      last = p + mlen;
+      n++;
+   }
+   if (n == 0) return 0;
+   buffer_append(&text, last, old + row->size - last);
+   if ((op = undo_push(at, 0, row->size, text.len, 0)) != NULL) {
+      memcpy(undo_text(op), old, row->size);
+      memcpy(undo_text(op) + row->size, text.data, text.len);
+   }
+
+   row_shed(row);
+   row_release(row);
+   row->frozen = 0;
+   row->cap = text.len + 1;
+   row->data = row_alloc(&row->cap);
+   memcpy(row->data, text.data, text.len);
+   row->data[text.len] = '\0';
+   row->size = text.len;
+   row->gap = text.len;
+   row->view = 0;
+   return n;
+}
+
+/* keeps the first two lines changed by a replace in changed */
+
+void replace_changed(int *changed, int at) {
+   if (at < changed[0]) {
+      changed[1] = changed[0];
+      changed[0] = at;
+   } else if (at < changed[1]) {
+      changed[1] = at;
+   }
+}
+
+/* replaces the matches in the lines [at, at + nlines), which are the
+ * mapping lines from first on. the run is searched as one stretch of
+ * text, since no match can reach over a line break, and only the lines
+ * holding a match are made into rows. the rows and the runs left
+ * between them are joined into a treap of their own, which takes the
+ * place of the run with a single split of the line store. returns the
+ * number of matches replaced */
+
+int replace_run(int at, int first, int nlines, search_query *q, char *with, int wlen, int *changed) {
+   line_node *built;
+   line_node *l;
+   line_node *m;
+   line_node *r;
+   ed_row_data *row;
+   char *start;
+   char *end;
+   char *p;
+   int count;
+   int line;
+   int done;
+   int mlen;
+
+   start = E.map + E.linestart[first];
+   end = E.map + E.linestart[first + nlines];
+   if (end > E.map + E.maplen) end = E.map + E.maplen;
+   p = search_line(q, start, end - start, start, &mlen);
+   if (p == NULL) return 0;
+
+   built = NULL;
+   count = 0;
+   line = first;
+   done = first;
+   while (p) {
+      while (E.linestart[line + 1] <= (size_t) (p - E.map)) line++;
+      row = row_view(line);
+      count += replace_in_row(row, at + line - first, q, with, wlen);
+      replace_changed(changed, at + line - first);
+      if (line > done) built = rows_merge(built, node_new(NULL, done, line - done));
+      built = rows_merge(built, node_new(row, 0, 1));
+      done = line + 1;
+      p = (done < first + nlines) ? search_line(q, start, end - start, E.map + E.linestart[done], &mlen) : NULL;
+   }
+   if (done < first + nlines) built = rows_merge(built, node_new(NULL, done, first + nlines - done));
+
+   rows_split(E.store, at, &l, &r);
+   rows_split(r, nlines, &m, &r);
+   slab_free(&E.nodepool, m);
+   E.store = rows_merge(rows_merge(l, built), r);
+   return count;
+}
+
+/* replaces every match of the query with with, in one pass over the
+ * line store. every line holding a match is rewritten once, and the
+ * comment states from the first of them on are found again while
+ * idle. the rewrites are undone together. returns the number of
+ * matches replaced */
+
+int replace_all(search_query *q, char *with) {
+   line_node *n;
+   int changed[2];
+   int count;
+   int wlen;
+   int off;
+   int at;
+   int k;
+
+   if (!q->valid || q->len == 0) return 0;
+   wlen = strlen(with);
+   count = 0;
+   changed[0] = E.numrows;
+   changed[1] = E.numrows;
+   undo_begin();
+   at = 0;
+   while (at < E.numrows) {
+      n = rows_find(at, &off);
+      if (n->row == NULL) {
+         k = n->nlines - off;
+         count += replace_run(at, n->first + off, k, q, with, wlen, changed);
+         at += k;
+         continue;
+      }
+      k = replace_in_row(n->row, at, q, with, wlen);
+      if (k) replace_changed(changed, at);
+      count += k;
+      at++;
+   }
+   undo_end();
+
+   if (changed[0] < E.hl_valid) {
+      E.hl_chain = (changed[1] < E.hl_valid) ? changed[1] : E.hl_valid;
+      E.hl_valid = changed[0];
+   } else if (E.hl_chain > changed[0]) {
+      E.hl_chain = changed[0];
+   }
+   E.mod += count;
+   return count;
+}
+
+void replace_editor() {
+   int old_cx;
+   int old_cy;
+   int old_coloff;
+   int old_rowoff;
+   char *pat;
+   char *with;
+   long start;
+   int count;
+   int len;
+
+   old_cx = E.cx;
+   old_cy = E.cy;
+   old_coloff = E.coloff;
+   old_rowoff = E.rowoff;
+
+   E.search.valid = 0;
+   E.find_replace = 1;
+   find_set_prompt();
+   pat = editor_prompt(E.find_prompt, 0, callback_find);
+   E.find_replace = 0;
+   with = pat ? editor_prompt("Replace with : %s [ESC to cancel]", 1, NULL) : NULL;
+
+   E.cx = old_cx;
+   E.cy = old_cy;
+   E.coloff = old_coloff;
+   E.rowoff = old_rowoff;
+   if (with) {
+      start = now_ms();
+      count = replace_all(&E.search, with);
+      set_status_extra("%d replaced in %ld ms%s", count, now_ms() - start,
+         E.undo.lost ? ", too many to undo" : "");
+      if (E.cy < E.numrows) {
+         line_peek(E.cy, &len);
+         if (E.cx > len) E.cx = len;
+      }
+   }
+   E.search.valid = 0;
+   free(pat);
+   free(with);
+}
+
 /* input */
 
 void cursor_move(int key) {
    int rowlen;
-   ed_row_data *row = (E.cy >= E.numrows) ? NULL : &E.rows_data[E.cy];
+   ed_row_data *row = (E.cy >= E.numrows) ? NULL : row_at(E.cy);
    switch (key) {
       case ARROWU:
          if (E.cy != 0) E.cy--;
@@ -897,24 +5534,47 @@ void cursor_move(int key) {
          if (E.cx != 0) E.cx--;
          else if (E.cy > 0) {
             E.cy--;
-            E.cx = E.rows_data[E.cy].size;
+            E.cx = row_at(E.cy)->size;
          }
          break;
       case HOME: 
          E.cx = 0;
-         while (isspace(row->data[E.cx])) E.cx++;
+         while (row && E.cx < row->size && isspace(row_char(row, E.cx))) E.cx++;
          break;
       case END : E.cx = row ? row->size : 0; break;
+      case PAGEUP:
+         E.cy = (E.cy > E.rows) ? E.cy - E.rows : 0;
+         break;
+      case PAGEDOWN:
+         E.cy = (E.cy + E.rows < E.numrows) ? E.cy + E.rows : E.numrows;
+         break;
    }
    
-   row = (E.cy >= E.numrows) ? NULL : &E.rows_data[E.cy];
+   row = (E.cy >= E.numrows) ? NULL : row_at(E.cy);
    rowlen = row ? row->size : 0;
    if (E.cx > rowlen) E.cx = rowlen;
 }
 
 void key_proc() {
    static int quit_times = QUIT_CONF_CONTROL;
+   struct buffer paste = BUFFER_INIT;
    int c = read_key();
+
+   /* a file being followed can only be looked at */
+   if (E.stream.notify != -1) switch (c) {
+      case QUIT_KEY: case ARROWL: case ARROWU: case ARROWR: case ARROWD:
+      case HOME: case END: case PAGEUP: case PAGEDOWN: case FIND_KEY:
+      case '\x1b': case CTRL('l'):
+         break;
+      case PASTE:
+         read_paste(&paste);
+         buffer_free(&paste);
+         /* fall through */
+      default:
+         set_status_extra("%.40s is being followed, it cannot be changed", E.filename);
+         return;
+   }
+
    switch (c) {
 
       case '\r':
@@ -922,6 +5582,7 @@ void key_proc() {
          break;
       
       case QUIT_KEY:
+         save_reap(1);
          if (E.mod && quit_times > 0) {
             set_status_extra(
                "%d unsaved changes ! Close %d times more to quit.",
@@ -931,12 +5592,15 @@ void key_proc() {
             quit_times--;
             return;
          }
+         rows_free_all();
          write(STDOUT_FILENO, "\x1b[2J", 3);
          write(STDOUT_FILENO, "\x1b[H", 3);
          exit(0);
          break;
       
       case ARROWL: case ARROWU: case ARROWR: case ARROWD: case HOME: case END:
+      case PAGEUP: case PAGEDOWN:
+         E.undo.open = 0;
          cursor_move(c);
          break;
       
@@ -945,7 +5609,11 @@ void key_proc() {
          delete_char();
          break;
 
-      case '\x1b': case CTRL('l'):
+      case '\x1b':
+         E.search.valid = 0;
+         break;
+
+      case CTRL('l'):
          break;
 
       case SAVE_KEY:
@@ -953,20 +5621,43 @@ void key_proc() {
          break;
 
       case FIND_KEY:
+         E.undo.open = 0;
          find_editor();
          break;
 
+      case REPLACE_KEY:
+         replace_editor();
+         break;
+
+      case UNDO_KEY:
+         undo_editor(0);
+         break;
+
+      case REDO_KEY:
+         undo_editor(1);
+         break;
+
+      case PASTE:
+         read_paste(&paste);
+         insert_text(paste.data, paste.len, 0);
+         buffer_free(&paste);
+         break;
+
       default:
          insert_char(c);
    }
    quit_times = QUIT_CONF_CONTROL;
 }
 
-char* editor_prompt(char *prompt, void (*callback)(char*, int)) {
+/* reads a line in the status bar. an empty one is only taken when
+ * empty is set */
+
+char* editor_prompt(char *prompt, int empty, void (*callback)(char*, int)) {
    size_t input_buf_size; 
    size_t input_buf_len; 
    char *input_buf;
    int c;
+   int i;
 
    input_buf_size = 128;
    input_buf = malloc(input_buf_size);
@@ -975,6 +5666,7 @@ char* editor_prompt(char *prompt, void (*callback)(char*, int)) {
 
    while(1) {
       set_status_extra(prompt, input_buf);
+      timer_cancel(&E.status_timer);
       refresh_screen();
 
       c = read_key();
@@ -986,12 +5678,26 @@ char* editor_prompt(char *prompt, void (*callback)(char*, int)) {
          free(input_buf);
          return NULL;
       } else if (c == '\r') {
-         if (input_buf_len != 0) {
+         if (input_buf_len != 0 || empty) {
             set_status_extra("");
             if (callback) callback(input_buf, c);
             return input_buf;
          }
       }
+      else if (c == PASTE) {
+         struct buffer paste = BUFFER_INIT;
+         read_paste(&paste);
+         for (i = 0; i < paste.len && paste.data[i] != '\r' && paste.data[i] != '\n'; i++) {
+            if (iscntrl((unsigned char) paste.data[i])) continue;
+            if (input_buf_len == input_buf_size - 1) {
+               input_buf_size *= 2;
+               input_buf = realloc(input_buf, input_buf_size);
+            }
+            input_buf[input_buf_len++] = paste.data[i];
+         }
+         input_buf[input_buf_len] = '\0';
+         buffer_free(&paste);
+      }
       else if (!iscntrl(c) && c < 128) {
          if (input_buf_len == input_buf_size - 1) {
             input_buf_size *= 2;
@@ -1007,6 +5713,8 @@ char* editor_prompt(char *prompt, void (*callback)(char*, int)) {
 /* initialization */
 
 void init() {
+   struct sigaction sa;
+
    E.cx = 0;
    E.cy = 0;
    E.rx = 0;
@@ -1014,30 +5722,82 @@ void init() {
    E.coloff = 0;
    E.numrows = 0;
    E.mod = 0;
-   E.rows_data = NULL;
+   E.store = NULL;
+   E.linestart = NULL;
    E.filename = NULL;
+   E.map = NULL;
+   E.maplen = 0;
+   E.mapfd = -1;
+   E.mapcr = 0;
+   E.mapcomment = NULL;
+   E.mapknown = NULL;
+   memset(&E.save, 0, sizeof(E.save));
+   memset(&E.load, 0, sizeof(E.load));
+   memset(&E.stream, 0, sizeof(E.stream));
+   E.stream.fd = -1;
+   E.stream.notify = -1;
+   E.stream.watch = -1;
+   memset(&E.undo, 0, sizeof(E.undo));
+   E.undo.last = -1;
+   slabs_init();
+   pthread_mutex_init(&E.save.lock, NULL);
+   pthread_mutex_init(&E.load.lock, NULL);
+   E.hl_valid = 0;
+   E.hl_chain = 0;
    E.syntax = NULL;
-   E.statis_extra_time = 0;
+   E.kwtab = NULL;
+   build_char_classes();
    E.status_extra[0] = '\0';
+   E.status_timer.armed = 0;
+   E.ntimers = 0;
+   E.tick = now_ms() / TIMER_TICK;
+   E.inhead = 0;
+   E.intail = 0;
+
+   /* SIGWINCH only writes to a pipe, which editor_wait polls. it is
+    * made first, as term_size may wait for a key */
+   if (pipe(E.sigpipe) == -1) die("pipe");
+   fcntl(E.sigpipe[0], F_SETFL, O_NONBLOCK);
+   fcntl(E.sigpipe[1], F_SETFL, O_NONBLOCK);
+
    if (term_size(&E.rows, &E.cols) == -1) die("term_size");
+   frames_alloc(E.rows, E.cols);
+   E.out.data = NULL;
+   E.out.len = 0;
+   E.out.cap = 0;
    E.rows -= 2;
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = handle_winch;
+   sigemptyset(&sa.sa_mask);
+   sa.sa_flags = SA_RESTART;
+   if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
 }
 
 /* execution entry point */
 
 int main(int argc, char *argv[]) {
+   int fd;
+
+   fd = (argc >= 2 && !strcmp(argv[1], "-")) ? take_stdin() : -1;
    enable_raw();
    init();
 
-   if (argc >= 2) {
+   if (fd != -1) {
+      open_stream(fd);
+   } else if (argc >= 3 && !strcmp(argv[1], "-f")) {
+      open_follow(argv[2]);
+   } else if (argc >= 2) {
       open_editor(argv[1]);
    }
 
    set_status_extra("Read 'config.h' for keybindings");
 
+   /* keys that came in together, as when one is held down, are all
+    * handled before the screen is drawn again */
    while (1) {
       refresh_screen();
-      key_proc();
+      do key_proc(); while (input_pending());
    }
    disable_raw();
    return 0;
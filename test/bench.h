@@ -0,0 +1,81 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/* what the benchmarks share. each of them includes src/olich.c
+ * whole, with its main renamed, and then this. */
+
+/* seconds on a monotonic clock */
+
+double bench_now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* sets the editor up as init does, but for a screen of rows by cols
+ * that is not there, so nothing is asked of the terminal */
+
+void bench_init(int rows, int cols) {
+   E.mapfd = -1;
+   E.stream.fd = -1;
+   E.stream.notify = -1;
+   E.stream.watch = -1;
+   E.undo.last = -1;
+   slabs_init();
+   pthread_mutex_init(&E.save.lock, NULL);
+   pthread_mutex_init(&E.load.lock, NULL);
+   build_char_classes();
+   E.tick = now_ms() / TIMER_TICK;
+   if (pipe(E.sigpipe) == -1) die("pipe");
+   fcntl(E.sigpipe[0], F_SETFL, O_NONBLOCK);
+   fcntl(E.sigpipe[1], F_SETFL, O_NONBLOCK);
+   E.rows = rows;
+   E.cols = cols;
+   frames_alloc(E.rows, E.cols);
+   E.rows -= 2;
+}
+
+/* opens a file made of the sample at path repeated until it is at
+ * least lines lines long. it is named like the sample, so that the
+ * same syntax is picked for it. */
+
+void bench_open(char *path, int lines) {
+   char name[64];
+   char *sample;
+   char *ext;
+   long size;
+   int suffix;
+   int fd;
+   int n;
+   int i;
+   FILE *f;
+
+   f = fopen(path, "r");
+   if (f == NULL) die(path);
+   fseek(f, 0, SEEK_END);
+   size = ftell(f);
+   rewind(f);
+   sample = malloc(size);
+   if (fread(sample, 1, size, f) != (size_t) size) die(path);
+   fclose(f);
+   for (n = 0, i = 0; i < size; i++) n += (sample[i] == '\n');
+   if (n == 0) n = 1;
+
+   ext = strrchr(path, '.');
+   suffix = ext ? strlen(ext) : 0;
+   if (suffix > 8) suffix = 8;
+   snprintf(name, sizeof(name), "/tmp/olich-bench-XXXXXX%.*s", suffix, ext ? ext : "");
+   fd = mkstemps(name, suffix);
+   if (fd == -1) die("mkstemps");
+   for (i = 0; i < lines; i += n) {
+      if (write(fd, sample, size) != size) die("write");
+   }
+   close(fd);
+   free(sample);
+
+   open_editor(name);
+   unlink(name);
+   load_reap(1);
+}
+
+#endif
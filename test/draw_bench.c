@@ -0,0 +1,46 @@
+/* redraws a whole 200x60 screen of highlighted c, from test/hi.c
+ * unless another sample is given, frames times over :
+ *
+ *    draw_bench [sample] [frames]
+ *
+ * the screen is thrown away before every frame, so each of them is
+ * drawn and written out in full, to /dev/null. */
+
+#define main olich_main
+#include "../src/olich.c"
+#undef main
+
+#include "bench.h"
+
+int main(int argc, char *argv[]) {
+   double start;
+   double took;
+   long bytes;
+   int frames;
+   int out;
+   int i;
+
+   frames = (argc >= 3) ? atoi(argv[2]) : 10000;
+   bench_init(60, 200);
+   bench_open((argc >= 2) ? argv[1] : "test/hi.c", 1000);
+
+   /* the first frame highlights the rows on screen, which is not
+    * what is being measured */
+   out = dup(STDOUT_FILENO);
+   if (out == -1 || freopen("/dev/null", "w", stdout) == NULL) die("/dev/null");
+   refresh_screen();
+
+   bytes = 0;
+   start = bench_now();
+   for (i = 0; i < frames; i++) {
+      E.shown_valid = 0;
+      refresh_screen();
+      bytes += E.out.len;
+   }
+   took = bench_now() - start;
+
+   dup2(out, STDOUT_FILENO);
+   printf("draw : %d frames of %dx%d, %.1fus and %ld bytes each\n",
+         frames, E.cols, E.rows + 2, took * 1e6 / frames, bytes / frames);
+   return 0;
+}
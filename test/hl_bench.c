@@ -0,0 +1,42 @@
+/* highlights every row of a sample file blown up to a million lines,
+ * test/hi.c unless another is given :
+ *
+ *    hl_bench [sample] [lines]
+ *
+ * the sum printed with the time is over all the highlighting made,
+ * so that a change meant to be faster can be checked to highlight
+ * the same. */
+
+#define main olich_main
+#include "../src/olich.c"
+#undef main
+
+#include "bench.h"
+
+int main(int argc, char *argv[]) {
+   ed_row_data *row;
+   unsigned char *hl;
+   unsigned long sum;
+   double start;
+   double took;
+   int lines;
+   int at;
+   int j;
+
+   lines = (argc >= 3) ? atoi(argv[2]) : 1000000;
+   bench_init(60, 200);
+   bench_open((argc >= 2) ? argv[1] : "test/hi.c", lines);
+
+   start = bench_now();
+   for (at = 0; at < E.numrows; at++) editor_materialize_row(row_at(at), at);
+   took = bench_now() - start;
+
+   sum = 0;
+   for (at = 0; at < E.numrows; at++) {
+      row = row_at(at);
+      hl = row->highlighted + row_span(row, 0, row->size);
+      for (j = 0; j < row->size; j++) sum = sum * 31 + hl[j];
+   }
+   printf("highlight : %d lines in %.3fs, sum %08lx\n", E.numrows, took, sum & 0xffffffffUL);
+   return 0;
+}